@@ -0,0 +1,155 @@
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <evp.h>
+
+static constexpr std::size_t BLOCK_SIZE = 16;
+static constexpr std::size_t BULK_SIZE = 16 * 1024;
+static constexpr auto MIN_DURATION = std::chrono::milliseconds {200};
+static constexpr std::size_t EVICT_SIZE = 4 * 1024 * 1024;
+static constexpr std::size_t COLD_CALLS = 2000;
+
+static const unsigned char KEY[16] = {
+    0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+    0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c};
+static const unsigned char IV[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f};
+
+/*
+    Calls the function with size bytes repeatedly for MIN_DURATION at
+    least, and returns the nanoseconds per block.
+*/
+static double
+measure(const std::function<void(std::size_t)>& update, std::size_t size)
+{
+    using Clock = std::chrono::steady_clock;
+    std::size_t calls = 0;
+    auto start = Clock::now();
+    auto end = start;
+    do {
+        for (auto k = 0; k < 64; ++k) {
+            update(size);
+        }
+        calls += 64;
+        end = Clock::now();
+    } while (end - start < MIN_DURATION);
+    auto ns = std::chrono::duration<double, std::nano>(end - start).count();
+    return ns / (double)(calls * (size / BLOCK_SIZE));
+}
+
+/*
+    Calls the function with a single block COLD_CALLS times, writing over
+    EVICT_SIZE bytes before each call so that the lookup tables and round
+    keys are no longer in the caches, and returns the nanoseconds per block.
+    Only the calls are timed.
+*/
+static double
+measureCold(const std::function<void(std::size_t)>& update)
+{
+    using Clock = std::chrono::steady_clock;
+    static std::vector<unsigned char> evict(EVICT_SIZE);
+    std::chrono::duration<double, std::nano> total {0};
+    for (std::size_t k = 0; k < COLD_CALLS; ++k) {
+        for (std::size_t j = 0; j < evict.size(); j += 64) {
+            ++evict[j];
+        }
+        auto start = Clock::now();
+        update(BLOCK_SIZE);
+        total += Clock::now() - start;
+    }
+    return total.count() / (double)COLD_CALLS;
+}
+
+/*
+    Measures EVP_DecryptUpdate() with the padding disabled, so that the
+    blocks are not held back.
+*/
+static double
+measureDecrypt(const EVP_CIPHER* cipher, std::size_t size, bool cold = false)
+{
+    std::vector<unsigned char> in(BULK_SIZE);
+    std::vector<unsigned char> out(BULK_SIZE + BLOCK_SIZE);
+    auto* ctx = EVP_CIPHER_CTX_new();
+    EVP_DecryptInit_ex(ctx, cipher, nullptr, KEY, IV);
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    auto update = [&](std::size_t n) {
+        int outl;
+        EVP_DecryptUpdate(ctx, out.data(), &outl, in.data(), (int)n);
+    };
+    auto ns = cold ? measureCold(update) : measure(update, size);
+    EVP_CIPHER_CTX_free(ctx);
+    return ns;
+}
+
+static double
+measureEncrypt(std::size_t size)
+{
+    std::vector<unsigned char> in(BULK_SIZE);
+    std::vector<unsigned char> out(BULK_SIZE + BLOCK_SIZE);
+    auto* ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), nullptr, KEY, IV);
+    auto ns = measure([&](std::size_t n) {
+        int outl;
+        EVP_EncryptUpdate(ctx, out.data(), &outl, in.data(), (int)n);
+    }, size);
+    EVP_CIPHER_CTX_free(ctx);
+    return ns;
+}
+
+static void
+print(const char* backend, const char* name, std::size_t size, double ns)
+{
+    auto mbps = (double)BLOCK_SIZE * 1e3 / ns;
+    std::printf("%-10s %-16s %6zu %10.2f %10.1f\n", backend, name, size, ns,
+        mbps);
+}
+
+/*
+    Prints the nanoseconds per block and the throughput of the kernels of
+    each backend, for a single block per call and for BULK_SIZE bytes per
+    call. The difference between them is the cost per call, including the
+    loads of the round keys. The cold row is a single block right after the
+    caches are flushed, which is what the size of the lookup tables costs a
+    caller that decrypts little at a time between other work.
+*/
+int
+main(int ac, char** av)
+{
+    std::string only = (ac > 1) ? av[1] : "";
+    std::printf("%-10s %-16s %6s %10s %10s\n", "backend", "kernel", "bytes",
+        "ns/block", "MB/s");
+    unsigned int capabilities;
+    int supported;
+    const char* name;
+    for (auto k = 0;
+            (name = EVP_aes_backend_get(k, &capabilities, &supported))
+                != nullptr;
+            ++k) {
+        if (!supported || (!only.empty() && only != name)) {
+            continue;
+        }
+        if (!EVP_aes_backend_select(name)) {
+            continue;
+        }
+        for (auto size : {BLOCK_SIZE, BULK_SIZE}) {
+            print(name, "aes-128-cbc-dec", size,
+                measureDecrypt(EVP_aes_128_cbc(), size));
+            print(name, "aes-256-cbc-dec", size,
+                measureDecrypt(EVP_aes_256_cbc(), size));
+            print(name, "aes-128-ecb-dec", size,
+                measureDecrypt(EVP_aes_128_ecb(), size));
+            print(name, "aes-128-ctr", size,
+                measureDecrypt(EVP_aes_128_ctr(), size));
+            print(name, "aes-128-cbc-enc", size, measureEncrypt(size));
+        }
+        print(name, "cbc-dec (cold)", BLOCK_SIZE,
+            measureDecrypt(EVP_aes_128_cbc(), BLOCK_SIZE, true));
+    }
+    return 0;
+}
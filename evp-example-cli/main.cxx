@@ -1,23 +1,388 @@
+#include <algorithm>
+#include <cstddef>
 #include <fstream>
 #include <iostream>
+#include <new>
+#include <span>
+#include <string>
+#include <thread>
 
+#if defined(_WIN32)
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <asyncdecrypt.hpp>
+#include <chunksize.hpp>
+#include <container.hpp>
+#include <decryptor.hpp>
 #include <evp.h>
+#include <pagebuffer.hpp>
+
+static bool
+isStdio(const char* path)
+{
+    return std::string {path} == "-";
+}
+
+#if defined(_WIN32)
+
+static int
+openInput(const char* path)
+{
+    if (isStdio(path)) {
+        _setmode(0, _O_BINARY);
+        return 0;
+    }
+    return _open(path, _O_RDONLY | _O_BINARY);
+}
+
+static int
+openOutput(const char* path, bool truncate)
+{
+    if (isStdio(path)) {
+        _setmode(1, _O_BINARY);
+        return 1;
+    }
+    return _open(path,
+        _O_WRONLY | _O_CREAT | (truncate ? _O_TRUNC : 0) | _O_BINARY,
+        _S_IREAD | _S_IWRITE);
+}
+
+static long long
+readSome(int fd, std::byte* buffer, std::size_t size)
+{
+    return _read(fd, buffer, (unsigned int)size);
+}
+
+static long long
+writeSome(int fd, const std::byte* buffer, std::size_t size)
+{
+    return _write(fd, buffer, (unsigned int)size);
+}
+
+static long long
+fileSize(int fd)
+{
+    return _filelengthi64(fd);
+}
+
+static bool
+seekFile(int fd, long long offset)
+{
+    return _lseeki64(fd, offset, SEEK_SET) == offset;
+}
+
+static bool
+truncateFile(int fd, long long length)
+{
+    return _chsize_s(fd, length) == 0;
+}
 
-static unsigned char inbuf[1024 * 1024];
-static unsigned char outbuf[1024 * 1024];
+static void
+closeFile(int fd)
+{
+    if (fd > 2) {
+        _close(fd);
+    }
+}
+
+#else
+
+static int
+openInput(const char* path)
+{
+    if (isStdio(path)) {
+        return STDIN_FILENO;
+    }
+    return open(path, O_RDONLY);
+}
+
+static int
+openOutput(const char* path, bool truncate)
+{
+    if (isStdio(path)) {
+        return STDOUT_FILENO;
+    }
+    return open(path, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0666);
+}
+
+static long long
+readSome(int fd, std::byte* buffer, std::size_t size)
+{
+    return read(fd, buffer, size);
+}
+
+static long long
+writeSome(int fd, const std::byte* buffer, std::size_t size)
+{
+    return write(fd, buffer, size);
+}
+
+static long long
+fileSize(int fd)
+{
+    struct stat st;
+    return (fstat(fd, &st) == 0) ? (long long)st.st_size : -1;
+}
+
+static bool
+seekFile(int fd, long long offset)
+{
+    return lseek(fd, (off_t)offset, SEEK_SET) == (off_t)offset;
+}
+
+static bool
+truncateFile(int fd, long long length)
+{
+    return ftruncate(fd, (off_t)length) == 0;
+}
+
+static void
+closeFile(int fd)
+{
+    if (fd > STDERR_FILENO) {
+        close(fd);
+    }
+}
+
+#endif
+
+/*
+    Fills the buffer unless the end of the input is reached. Pipes return
+    short reads, but EVP_DecryptUpdate() requires a multiple of 16 bytes, so
+    a single read(2) is not enough.
+*/
+static long long
+readFully(int fd, std::byte* buffer, std::size_t size)
+{
+    std::size_t total = 0;
+    while (total < size) {
+        auto n = readSome(fd, buffer + total, size - total);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += (std::size_t)n;
+    }
+    return (long long)total;
+}
+
+static bool
+writeFully(int fd, std::span<const std::byte> data)
+{
+    auto* buffer = data.data();
+    auto size = data.size();
+    while (size > 0) {
+        auto n = writeSome(fd, buffer, size);
+        if (n <= 0) {
+            return false;
+        }
+        buffer += n;
+        size -= (std::size_t)n;
+    }
+    return true;
+}
+
+#if defined(_WIN32)
+
+/*
+    Reads the whole file into memory, in place of mapping it.
+*/
+static std::span<const std::byte>
+mapFile(int fd)
+{
+    auto size = fileSize(fd);
+    if (size <= 0) {
+        return {};
+    }
+    auto* image = new (std::nothrow) std::byte[(std::size_t)size];
+    if (image == nullptr) {
+        return {};
+    }
+    if (readFully(fd, image, (std::size_t)size) != size) {
+        delete[] image;
+        return {};
+    }
+    return {image, (std::size_t)size};
+}
+
+static void
+unmapFile(std::span<const std::byte> image)
+{
+    delete[] image.data();
+}
+
+#else
+
+static std::span<const std::byte>
+mapFile(int fd)
+{
+    auto size = fileSize(fd);
+    if (size <= 0) {
+        return {};
+    }
+    auto* image = mmap(nullptr, (std::size_t)size, PROT_READ, MAP_PRIVATE,
+        fd, 0);
+    if (image == MAP_FAILED) {
+        return {};
+    }
+    return {static_cast<const std::byte*>(image), (std::size_t)size};
+}
+
+static void
+unmapFile(std::span<const std::byte> image)
+{
+    munmap(const_cast<std::byte*>(image.data()), image.size());
+}
+
+#endif
+
+/*
+    Prepares to continue a decryption that was interrupted, from the length
+    of the output rounded down to a whole block: truncates the output to it
+    and positions both files there. In the CBC mode, the IV of the block at
+    that offset is the ciphertext block just before it, so iv is read from
+    the input and no checkpoint is needed. Returns the offset, or -1 if
+    the files cannot be positioned.
+*/
+static long long
+prepareResume(int input, int output, std::byte* iv)
+{
+    auto size = fileSize(output);
+    if (size < 0) {
+        return -1;
+    }
+    auto offset = size / 16 * 16;
+    if (!truncateFile(output, offset) || !seekFile(output, offset)) {
+        return -1;
+    }
+    if (offset > 0
+            && (!seekFile(input, offset - 16)
+                || readFully(input, iv, 16) != 16)) {
+        return -1;
+    }
+    return offset;
+}
+
+/*
+    Decrypts a container (see container.hpp) with the shared thread pool,
+    a batch of a few chunks per thread at a time, and writes each batch in
+    order. Returns an error message, or an empty string if it succeeds.
+*/
+static std::string
+decryptContainer(std::span<const std::byte> image,
+    std::span<const std::byte, 16> key, int output, bool hugePages,
+    bool verbose)
+{
+    static constexpr std::size_t MAX_BATCH_BYTES = 64 * 1024 * 1024;
+
+    auto reader = mimicssl::ContainerReader::open(image, key);
+    if (!reader) {
+        return "broken container";
+    }
+    auto chunkSize = reader->chunkSize();
+    auto threads = std::max(std::thread::hardware_concurrency(), 1u);
+    auto batch = std::clamp(MAX_BATCH_BYTES / chunkSize, (std::size_t)1,
+        (std::size_t)threads * 4);
+    if (verbose) {
+        std::cerr << "backend: " << EVP_aes_backend_name() << std::endl
+                  << "container: " << reader->chunkCount() << " chunks of "
+                  << chunkSize << " bytes, " << batch << " per batch"
+                  << std::endl;
+    }
+    auto buffer = mimicssl::PageBuffer::make(batch * chunkSize + 16,
+        hugePages);
+    if (!buffer) {
+        return "failed to allocate buffers";
+    }
+    auto& pool = mimicssl::ThreadPool::shared();
+    auto count = reader->chunkCount();
+    for (std::size_t first = 0; first < count; first += batch) {
+        auto n = std::min(batch, count - first);
+        auto plain = reader->decryptChunks(pool, first, n, buffer->bytes());
+        if (!plain) {
+            return "failed to decrypt chunks from " + std::to_string(first);
+        }
+        if (!writeFully(output, buffer->bytes().first(*plain))) {
+            return "failed to write";
+        }
+    }
+    return "";
+}
+
+static void
+printTuning(const mimicssl::ChunkTuning& tuning)
+{
+    auto& caches = tuning.caches;
+    std::cerr << "backend: " << EVP_aes_backend_name() << std::endl
+              << "caches: L1d " << caches.l1d / 1024 << " KiB, L2 "
+              << caches.l2 / 1024 << " KiB, L3 " << caches.l3 / 1024
+              << " KiB" << std::endl
+              << "chunk size: " << tuning.chunkSize << " bytes";
+    if (tuning.bytesPerSecond > 0) {
+        std::cerr << " (" << (long long)(tuning.bytesPerSecond / 1e6)
+                  << " MB/s)";
+    }
+    std::cerr << std::endl;
+}
 
 int
 main(int ac, char** av)
 {
-    unsigned char key[16];
-    unsigned char iv[16];
-    int inlen;
-    int outlen;
-    EVP_CIPHER_CTX* ctx;
+    std::byte key[16];
+    std::byte iv[16];
 
-    if (ac != 5) {
-        std::cerr << "usage: " << av[0]
-                  << " KEY_FILE IV_FILE INPUT_FILE OUTPUT_FILE" << std::endl;
+    auto* program = av[0];
+    auto hugePages = false;
+    auto verbose = false;
+    auto resume = false;
+    auto container = false;
+    for (; ac > 1 && std::string {av[1]}.starts_with("--"); --ac, ++av) {
+        std::string option {av[1]};
+        if (option == "--huge-pages") {
+            hugePages = true;
+        } else if (option == "--verbose") {
+            verbose = true;
+        } else if (option == "--resume") {
+            resume = true;
+        } else if (option == "--container") {
+            container = true;
+        } else {
+            ac = 0;
+            break;
+        }
+    }
+    // The container has the IVs, so IV_FILE is omitted with --container.
+    if (ac != (container ? 4 : 5)
+            || (container && (resume || isStdio(av[2])))
+            || (resume && (isStdio(av[3]) || isStdio(av[4])))) {
+        std::cerr << "usage: " << program
+                  << " [OPTIONS] KEY_FILE IV_FILE INPUT_FILE OUTPUT_FILE"
+                  << std::endl
+                  << "       " << program
+                  << " --container [OPTIONS] KEY_FILE INPUT_FILE OUTPUT_FILE"
+                  << std::endl
+                  << "INPUT_FILE and OUTPUT_FILE can be '-' for the standard "
+                  << "input and output." << std::endl
+                  << "OPTIONS:" << std::endl
+                  << "  --container   decrypt a chunked container in "
+                  << "parallel; INPUT_FILE must be a" << std::endl
+                  << "                file" << std::endl
+                  << "  --huge-pages  back the buffers with huge pages if "
+                  << "available" << std::endl
+                  << "  --resume      continue from the end of OUTPUT_FILE, "
+                  << "which must be a file" << std::endl
+                  << "  --verbose     print the chunk size and the caches"
+                  << std::endl;
         return 1;
     }
     std::ifstream keyFile {av[1], std::ios_base::in | std::ios_base::binary};
@@ -30,6 +395,34 @@ main(int ac, char** av)
         std::cerr << av[1] << ": failed to read" << std::endl;
         return 1;
     }
+    if (container) {
+        auto input = openInput(av[2]);
+        if (input < 0) {
+            std::cerr << av[2] << ": not found" << std::endl;
+            return 1;
+        }
+        auto image = mapFile(input);
+        closeFile(input);
+        if (image.empty()) {
+            std::cerr << av[2] << ": failed to read" << std::endl;
+            return 1;
+        }
+        auto output = openOutput(av[3], true);
+        if (output < 0) {
+            std::cerr << av[3] << ": failed to open" << std::endl;
+            unmapFile(image);
+            return 1;
+        }
+        auto error = decryptContainer(image, key, output, hugePages, verbose);
+        unmapFile(image);
+        closeFile(output);
+        if (!error.empty()) {
+            std::cerr << error << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
     std::ifstream ivFile {av[2], std::ios_base::in | std::ios_base::binary};
     if (!ivFile) {
         std::cerr << av[2] << ": not found" << std::endl;
@@ -41,57 +434,81 @@ main(int ac, char** av)
         return 1;
     }
 
-    if ((ctx = EVP_CIPHER_CTX_new()) == NULL) {
-        std::cerr << "EVP_CIPHER_CTX_new(): failed" << std::endl;
-        return 1;
+    auto& tuning = mimicssl::tunedChunkSize();
+    auto chunkSize = tuning.chunkSize;
+    if (verbose) {
+        printTuning(tuning);
     }
-    if (!EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv)) {
-        std::cerr << "EVP_DecryptInit_ex(): failed" << std::endl;
-        EVP_CIPHER_CTX_free(ctx);
+    // The input and output buffers are allocated together so that they
+    // share huge pages.
+    auto buffer = mimicssl::PageBuffer::make(2 * chunkSize, hugePages);
+    if (!buffer) {
+        std::cerr << "failed to allocate buffers" << std::endl;
         return 1;
     }
+    auto inbuf = buffer->bytes().first(chunkSize);
+    auto outbuf = buffer->bytes().subspan(chunkSize);
 
-    std::ifstream inputFile {av[3], std::ios_base::in | std::ios_base::binary};
-    if (!inputFile) {
-        std::cout << av[3] << ": not found" << std::endl;
+    auto input = openInput(av[3]);
+    if (input < 0) {
+        std::cerr << av[3] << ": not found" << std::endl;
+        return 1;
+    }
+    auto output = openOutput(av[4], !resume);
+    if (output < 0) {
+        std::cerr << av[4] << ": failed to open" << std::endl;
+        closeFile(input);
         return 1;
     }
-    std::ofstream outputFile {av[4],
-        std::ios_base::out | std::ios_base::trunc | std::ios_base::binary};
-    if (!outputFile) {
-        std::cout << av[4] << ": failed to open" << std::endl;
+    auto fail = [&](const std::string& message) {
+        std::cerr << message << std::endl;
+        closeFile(input);
+        closeFile(output);
         return 1;
+    };
+    if (resume) {
+        auto offset = prepareResume(input, output, iv);
+        if (offset < 0) {
+            return fail(std::string {av[4]} + ": failed to resume");
+        }
+        if (verbose) {
+            std::cerr << "resumed at " << offset << " bytes" << std::endl;
+        }
+    }
+
+    auto decryptor = mimicssl::Decryptor::make(EVP_aes_128_cbc(), key, iv);
+    if (!decryptor) {
+        return fail("EVP_DecryptInit_ex(): failed");
     }
 
     for (;;) {
-        if (inputFile.eof()) {
+        auto inlen = readFully(input, inbuf.data(), inbuf.size());
+        if (inlen < 0) {
+            return fail(std::string {av[3]} + ": failed to read");
+        }
+        if (inlen == 0) {
             break;
         }
-        inputFile.read((char*)inbuf, sizeof(inbuf));
-        inlen = inputFile.gcount();
-        if (!EVP_DecryptUpdate(ctx, outbuf, &outlen, inbuf, inlen)) {
-            std::cerr << "EVP_DecryptUpdate(): failed" << std::endl;
-            EVP_CIPHER_CTX_free(ctx);
-            return 1;
+        auto plain = decryptor->update(inbuf.first((std::size_t)inlen),
+            outbuf);
+        if (!plain) {
+            return fail("EVP_DecryptUpdate(): failed");
         }
-        outputFile.write((char*)outbuf, outlen);
-        if (outputFile.fail()) {
-            std::cerr << av[4] << ": failed to write" << std::endl;
-            return 1;
+        if (!writeFully(output, *plain)) {
+            return fail(std::string {av[4]} + ": failed to write");
+        }
+        if ((std::size_t)inlen < inbuf.size()) {
+            break;
         }
     }
-    if (!EVP_DecryptFinal_ex(ctx, outbuf, &outlen)) {
-        std::cerr << "EVP_DecryptFinal_ex(): failed" << std::endl;
-        EVP_CIPHER_CTX_free(ctx);
-        return 1;
+    auto last = decryptor->finish(outbuf);
+    if (!last) {
+        return fail("EVP_DecryptFinal_ex(): failed");
     }
-    if (outlen > 0) {
-        outputFile.write((char*)outbuf, outlen);
-        if (outputFile.fail()) {
-            std::cout << av[4] << ": failed to write" << std::endl;
-            return 1;
-        }
+    if (!writeFully(output, *last)) {
+        return fail(std::string {av[4]} + ": failed to write");
     }
-    EVP_CIPHER_CTX_free(ctx);
+    closeFile(input);
+    closeFile(output);
     return 0;
 }
@@ -0,0 +1,309 @@
+#ifndef asyncdecrypt_HPP
+#define asyncdecrypt_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "evp.h"
+
+namespace mimicssl {
+
+/*
+    What decryptAsync() submits the jobs to: anything that runs the
+    function it is given, sooner or later, on some thread. To use an asio
+    executor, for example, wrap it in a type whose execute() calls
+    asio::post().
+*/
+template <typename E>
+concept Executor = requires(E& e, std::function<void()> f) {
+    e.execute(std::move(f));
+};
+
+/*
+    A fixed-size pool of threads that run the jobs in FIFO order.
+*/
+class ThreadPool final {
+public:
+    explicit ThreadPool(unsigned threads = defaultThreads())
+    {
+        for (unsigned k = 0; k < threads; ++k) {
+            workers.emplace_back([this](std::stop_token stop) {
+                run(stop);
+            });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    auto operator=(const ThreadPool&) -> ThreadPool& = delete;
+
+    ~ThreadPool()
+    {
+        for (auto& w : workers) {
+            w.request_stop();
+        }
+        ready.notify_all();
+    }
+
+    auto execute(std::function<void()> job) -> void
+    {
+        {
+            std::lock_guard lock {mutex};
+            jobs.push_back(std::move(job));
+        }
+        ready.notify_one();
+    }
+
+    /*
+        The pool that decryptAsync() uses unless another executor is given.
+    */
+    static auto shared() -> ThreadPool&
+    {
+        static ThreadPool pool;
+        return pool;
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable_any ready;
+    std::deque<std::function<void()>> jobs;
+    std::vector<std::jthread> workers;
+
+    static auto defaultThreads() -> unsigned
+    {
+        return std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    auto run(std::stop_token stop) -> void
+    {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock lock {mutex};
+                if (!ready.wait(lock, stop, [this] {
+                        return !jobs.empty();
+                    })) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+/*
+    The awaitable that decryptAsync() returns. The ciphertext is split into
+    block-aligned chunks, and each chunk is decrypted with its own context
+    whose IV is the last ciphertext block of the previous chunk (or, in the
+    CTR mode, the counter advanced by the blocks before the chunk), so that
+    the chunks are decrypted in parallel. The coroutine is resumed on the
+    thread that finishes the last chunk.
+*/
+template <Executor E>
+class DecryptAwaiter final {
+public:
+    DecryptAwaiter(E& executor, const EVP_CIPHER* cipher,
+        std::span<const std::byte> key, std::span<const std::byte, 16> iv,
+        std::span<const std::byte> in, std::span<std::byte> out,
+        std::size_t chunkSize)
+        : executor {executor},
+          in {in},
+          out {out}
+    {
+        // Only the CTR mode takes a ciphertext of any length.
+        auto ctr = (cipher == EVP_aes_128_ctr());
+        if (in.empty() || (!ctr && in.size() % 16 != 0)
+                || out.size() < in.size() || in.size() > (std::size_t)INT_MAX
+                || key.size() != (std::size_t)EVP_CIPHER_key_length(cipher)) {
+            return;
+        }
+        chunkSize = std::max(chunkSize & ~(std::size_t)15, (std::size_t)16);
+        auto count = (in.size() + chunkSize - 1) / chunkSize;
+        contexts.reserve(count);
+        for (std::size_t k = 0; k < count; ++k) {
+            auto* c = EVP_CIPHER_CTX_new();
+            if (c == nullptr) {
+                return;
+            }
+            contexts.push_back(c);
+        }
+        std::vector<const unsigned char*> keys(count, toUchar(key.data()));
+        std::vector<const unsigned char*> ivs(count);
+        std::vector<std::array<std::byte, 16>> counters(ctr ? count : 0);
+        ivs[0] = toUchar(iv.data());
+        for (std::size_t k = 1; k < count; ++k) {
+            if (ctr) {
+                counters[k] = addCounter(iv, k * chunkSize / 16);
+                ivs[k] = toUchar(counters[k].data());
+            } else {
+                ivs[k] = toUchar(in.data() + k * chunkSize - 16);
+            }
+        }
+        if (!EVP_DecryptInit_multi(contexts.data(), cipher, keys.data(),
+                ivs.data(), (int)count)) {
+            return;
+        }
+        for (std::size_t k = 0; k + 1 < count; ++k) {
+            EVP_CIPHER_CTX_set_padding(contexts[k], 0);
+        }
+        this->chunkSize = chunkSize;
+        lengths.resize(count);
+        remaining.store(count, std::memory_order_relaxed);
+    }
+
+    DecryptAwaiter(const DecryptAwaiter&) = delete;
+    auto operator=(const DecryptAwaiter&) -> DecryptAwaiter& = delete;
+
+    ~DecryptAwaiter()
+    {
+        for (auto* c : contexts) {
+            EVP_CIPHER_CTX_free(c);
+        }
+    }
+
+    auto await_ready() const noexcept -> bool
+    {
+        return lengths.empty();
+    }
+
+    /*
+        Once the last job is submitted, the coroutine may already be resumed
+        and this awaiter destroyed, so nothing here touches the members
+        after that.
+    */
+    auto await_suspend(std::coroutine_handle<> h) -> void
+    {
+        handle = h;
+        E& e = executor;
+        auto count = lengths.size();
+        for (std::size_t k = 0; k < count; ++k) {
+            e.execute([this, k] {
+                decryptChunk(k);
+            });
+        }
+    }
+
+    /*
+        Returns the length of the plaintext, or std::nullopt if the
+        decryption fails.
+    */
+    auto await_resume() const noexcept -> std::optional<std::size_t>
+    {
+        if (lengths.empty() || failed.load(std::memory_order_relaxed)) {
+            return std::nullopt;
+        }
+        std::size_t total = 0;
+        for (auto n : lengths) {
+            total += n;
+        }
+        return total;
+    }
+
+private:
+    E& executor;
+    std::span<const std::byte> in;
+    std::span<std::byte> out;
+    std::size_t chunkSize = 0;
+    std::vector<EVP_CIPHER_CTX*> contexts;
+    std::vector<std::size_t> lengths;
+    std::atomic<std::size_t> remaining {0};
+    std::atomic<bool> failed {false};
+    std::coroutine_handle<> handle;
+
+    static auto toUchar(const std::byte* p) noexcept -> const unsigned char*
+    {
+        return reinterpret_cast<const unsigned char*>(p);
+    }
+
+    static auto toUchar(std::byte* p) noexcept -> unsigned char*
+    {
+        return reinterpret_cast<unsigned char*>(p);
+    }
+
+    /*
+        Returns the 128-bit big-endian counter block plus blocks, with the
+        carry, as the CTR mode increments it.
+    */
+    static auto addCounter(std::span<const std::byte, 16> counter,
+        std::uint64_t blocks) noexcept -> std::array<std::byte, 16>
+    {
+        std::array<std::byte, 16> sum;
+        unsigned carry = 0;
+        for (std::size_t k = 16; k-- > 0;) {
+            auto b = (unsigned)counter[k] + (unsigned)(blocks & 0xff) + carry;
+            sum[k] = (std::byte)b;
+            carry = b >> 8;
+            blocks >>= 8;
+        }
+        return sum;
+    }
+
+    auto decryptChunk(std::size_t k) -> void
+    {
+        auto* c = contexts[k];
+        auto start = k * chunkSize;
+        auto size = std::min(chunkSize, in.size() - start);
+        auto* o = toUchar(out.data() + start);
+        int outl = 0;
+        int finalLength = 0;
+        if (!EVP_DecryptUpdate(c, o, &outl, toUchar(in.data() + start),
+                (int)size)
+                || (k + 1 == lengths.size()
+                    && !EVP_DecryptFinal_ex(c, o + outl, &finalLength))) {
+            failed.store(true, std::memory_order_relaxed);
+        }
+        lengths[k] = (std::size_t)outl + (std::size_t)finalLength;
+        if (remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            handle.resume();
+        }
+    }
+};
+
+/*
+    Decrypts the whole ciphertext in (including the padding) into out, which
+    must be at least as long as in, without blocking the caller:
+
+        auto length = co_await decryptAsync(pool, EVP_aes_128_cbc(), key,
+            iv, in, out);
+
+    The jobs of chunkSize bytes each are submitted to the executor, and the
+    chunks are decrypted in parallel. In the CTR mode, in may have any
+    length; otherwise, it must be a multiple of 16.
+*/
+template <Executor E>
+auto decryptAsync(E& executor, const EVP_CIPHER* cipher,
+    std::span<const std::byte> key, std::span<const std::byte, 16> iv,
+    std::span<const std::byte> in, std::span<std::byte> out,
+    std::size_t chunkSize = 256 * 1024) -> DecryptAwaiter<E>
+{
+    return {executor, cipher, key, iv, in, out, chunkSize};
+}
+
+inline auto decryptAsync(const EVP_CIPHER* cipher,
+    std::span<const std::byte> key, std::span<const std::byte, 16> iv,
+    std::span<const std::byte> in, std::span<std::byte> out,
+    std::size_t chunkSize = 256 * 1024) -> DecryptAwaiter<ThreadPool>
+{
+    return {ThreadPool::shared(), cipher, key, iv, in, out, chunkSize};
+}
+
+} // namespace mimicssl
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef chunksize_HPP
+#define chunksize_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "evp.h"
+
+namespace mimicssl {
+
+/*
+    The sizes of the data caches of the first CPU in bytes, each of which
+    is zero if unknown. They are read from sysfs on Linux only.
+*/
+struct CacheSizes {
+    std::size_t l1d = 0;
+    std::size_t l2 = 0;
+    std::size_t l3 = 0;
+
+    static auto read() -> CacheSizes
+    {
+        CacheSizes caches;
+#if defined(__linux__)
+        for (auto k = 0; k < 8; ++k) {
+            auto dir = "/sys/devices/system/cpu/cpu0/cache/index"
+                + std::to_string(k) + "/";
+            auto level = readLine(dir + "level");
+            auto type = readLine(dir + "type");
+            auto size = parseSize(readLine(dir + "size"));
+            if (!level || !type || !size || *type == "Instruction") {
+                continue;
+            }
+            if (*level == "1") {
+                caches.l1d = *size;
+            } else if (*level == "2") {
+                caches.l2 = *size;
+            } else if (*level == "3") {
+                caches.l3 = *size;
+            }
+        }
+#endif
+        return caches;
+    }
+
+    /*
+        Parses a size with an optional suffix K, M, or G (e.g., "48K"), as
+        sysfs and MIMICSSL_CHUNK_SIZE write it. Returns std::nullopt if it
+        is malformed or greater than INT_MAX, the most that EVP_DecryptUpdate()
+        takes at once.
+    */
+    static auto parseSize(const std::optional<std::string>& s)
+        -> std::optional<std::size_t>
+    {
+        if (!s || s->empty() || (*s)[0] < '0' || (*s)[0] > '9') {
+            return std::nullopt;
+        }
+        char* end;
+        errno = 0;
+        auto value = std::strtoull(s->c_str(), &end, 10);
+        if (errno == ERANGE) {
+            return std::nullopt;
+        }
+        auto unit = std::string {end};
+        auto shift = (unit == "") ? 0
+            : (unit == "K") ? 10
+            : (unit == "M") ? 20
+            : (unit == "G") ? 30
+            : -1;
+        if (shift < 0 || value > (unsigned long long)INT_MAX >> shift) {
+            return std::nullopt;
+        }
+        return (std::size_t)value << shift;
+    }
+
+private:
+    static auto readLine(const std::string& path)
+        -> std::optional<std::string>
+    {
+        std::ifstream file {path};
+        std::string line;
+        if (!std::getline(file, line)) {
+            return std::nullopt;
+        }
+        return line;
+    }
+};
+
+/*
+    The chunk size that tuneChunkSize() picks. bytesPerSecond is the
+    throughput measured with it, or zero if it is not measured.
+*/
+struct ChunkTuning {
+    std::size_t chunkSize;
+    double bytesPerSecond;
+    CacheSizes caches;
+};
+
+namespace detail {
+
+inline constexpr std::size_t MIN_CHUNK_SIZE = 16 * 1024;
+inline constexpr std::size_t MAX_CHUNK_SIZE = 2 * 1024 * 1024;
+inline constexpr std::size_t DEFAULT_CHUNK_SIZE = 256 * 1024;
+inline constexpr std::size_t TUNING_SIZE = 4 * 1024 * 1024;
+
+/*
+    The powers of two from MIN_CHUNK_SIZE to MAX_CHUNK_SIZE, and the sizes
+    with which the input and output buffers fill half of L1d or L2.
+*/
+inline auto chunkCandidates(const CacheSizes& caches)
+    -> std::vector<std::size_t>
+{
+    std::vector<std::size_t> candidates;
+    for (auto c = MIN_CHUNK_SIZE; c <= MAX_CHUNK_SIZE; c *= 2) {
+        candidates.push_back(c);
+    }
+    for (auto cache : {caches.l1d, caches.l2}) {
+        auto c = cache / 4 / 4096 * 4096;
+        if (c >= MIN_CHUNK_SIZE && c <= MAX_CHUNK_SIZE) {
+            candidates.push_back(c);
+        }
+    }
+    std::ranges::sort(candidates);
+    auto [first, last] = std::ranges::unique(candidates);
+    candidates.erase(first, last);
+    return candidates;
+}
+
+/*
+    Streams size bytes from source to sink as the CLI does: copies a chunk
+    into in (as read(2) does), decrypts it into out, and copies it to sink
+    (as write(2) does). Returns the elapsed time in seconds.
+*/
+inline auto streamChunks(EVP_CIPHER_CTX* ctx, const unsigned char* source,
+    unsigned char* sink, std::size_t size, unsigned char* in,
+    unsigned char* out, std::size_t chunkSize) -> double
+{
+    using Clock = std::chrono::steady_clock;
+    auto start = Clock::now();
+    for (std::size_t offset = 0; offset < size; offset += chunkSize) {
+        auto n = std::min(chunkSize, size - offset);
+        std::memcpy(in, source + offset, n);
+        int outl = 0;
+        EVP_DecryptUpdate(ctx, out, &outl, in, (int)n);
+        std::memcpy(sink + offset, out, (std::size_t)outl);
+    }
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+} // namespace detail
+
+/*
+    Picks the chunk size for streaming the cipher with the current backend.
+    With a hardware backend, the cost per call and the working set both
+    matter, so it streams TUNING_SIZE bytes with each candidate twice
+    (tens of milliseconds in total) and picks the smallest one within 3%
+    of the fastest. With a software backend, the cost per call hardly
+    matters, so it picks the size with which the input and output buffers
+    fill half of L2 without measuring.
+*/
+inline auto tuneChunkSize(const EVP_CIPHER* cipher = EVP_aes_128_cbc())
+    -> ChunkTuning
+{
+    using detail::DEFAULT_CHUNK_SIZE;
+    using detail::MAX_CHUNK_SIZE;
+    using detail::MIN_CHUNK_SIZE;
+    using detail::TUNING_SIZE;
+
+    auto caches = CacheSizes::read();
+    auto fallback = (caches.l2 == 0)
+        ? DEFAULT_CHUNK_SIZE
+        : std::clamp(caches.l2 / 4 / 4096 * 4096, MIN_CHUNK_SIZE,
+            MAX_CHUNK_SIZE);
+    std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> ctx {
+        EVP_CIPHER_CTX_new(), EVP_CIPHER_CTX_free};
+    unsigned char key[32] = {};
+    unsigned char iv[16] = {};
+    if (ctx == nullptr
+            || !EVP_DecryptInit_ex(ctx.get(), cipher, nullptr, key, iv)) {
+        return {fallback, 0, caches};
+    }
+    if (!(EVP_aes_backend_capabilities() & EVP_AES_BACKEND_HARDWARE)) {
+        return {fallback, 0, caches};
+    }
+    EVP_CIPHER_CTX_set_padding(ctx.get(), 0);
+    auto source = std::make_unique<unsigned char[]>(TUNING_SIZE);
+    auto sink = std::make_unique<unsigned char[]>(TUNING_SIZE);
+    auto in = std::make_unique<unsigned char[]>(MAX_CHUNK_SIZE);
+    auto out = std::make_unique<unsigned char[]>(MAX_CHUNK_SIZE);
+    auto candidates = detail::chunkCandidates(caches);
+    std::vector<double> seconds(candidates.size(), 0);
+    for (auto pass = 0; pass < 2; ++pass) {
+        for (std::size_t k = 0; k < candidates.size(); ++k) {
+            auto s = detail::streamChunks(ctx.get(), source.get(),
+                sink.get(), TUNING_SIZE, in.get(), out.get(), candidates[k]);
+            seconds[k] = (pass == 0) ? s : std::min(seconds[k], s);
+        }
+    }
+    auto fastest = *std::ranges::min_element(seconds);
+    for (std::size_t k = 0; k < candidates.size(); ++k) {
+        if (seconds[k] <= fastest * 1.03) {
+            return {candidates[k], (double)TUNING_SIZE / seconds[k], caches};
+        }
+    }
+    return {fallback, 0, caches};
+}
+
+/*
+    The chunk size that DecryptBuf and the CLI use: the environment
+    variable MIMICSSL_CHUNK_SIZE (e.g., 256K) if it is set, otherwise the
+    result of tuneChunkSize() for AES-128 CBC on the first call.
+*/
+inline auto tunedChunkSize() -> const ChunkTuning&
+{
+    static const ChunkTuning tuning = [] {
+        auto* env = std::getenv("MIMICSSL_CHUNK_SIZE");
+        if (env != nullptr) {
+            auto size = CacheSizes::parseSize(std::string {env});
+            if (size && *size >= 16) {
+                return ChunkTuning {*size / 16 * 16, 0, CacheSizes::read()};
+            }
+        }
+        return tuneChunkSize();
+    }();
+    return tuning;
+}
+
+} // namespace mimicssl
+
+#endif
@@ -0,0 +1,325 @@
+#ifndef container_HPP
+#define container_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <latch>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "asyncdecrypt.hpp"
+#include "decryptor.hpp"
+#include "evp.h"
+
+namespace mimicssl {
+
+/*
+    A container of AES-128 CBC ciphertext split into chunks of a fixed size,
+    each of which can be decrypted on its own, so in parallel or at random.
+    The integers are little endian:
+
+        0   MAGIC
+        8   VERSION
+        9   flags (CHUNK_IVS)
+        10  reserved (zero)
+        12  chunk size (a nonzero multiple of 16)
+        16  number of the chunks (n > 0)
+        24  IV of the first chunk
+        40  offsets of the n chunks and of their end, 8 bytes each
+            IVs of the n chunks, 16 bytes each, only with CHUNK_IVS
+            the chunks
+
+    Each chunk but the last has exactly the chunk size of ciphertext, and
+    only the last one has the PKCS#7 padding. Without CHUNK_IVS, the chunks
+    are a single CBC stream, so the IV of a chunk is the last ciphertext
+    block of the previous one. With CHUNK_IVS, each chunk is encrypted with
+    its own IV.
+*/
+struct ContainerFormat {
+    static constexpr std::array<std::byte, 8> MAGIC = {
+        std::byte {'M'}, std::byte {'S'}, std::byte {'S'}, std::byte {'L'},
+        std::byte {'C'}, std::byte {'H'}, std::byte {'N'}, std::byte {'K'}};
+    static constexpr std::uint8_t VERSION = 1;
+    static constexpr std::uint8_t CHUNK_IVS = 0x01;
+    static constexpr std::size_t HEADER_SIZE = 40;
+    static constexpr std::size_t BLOCK_SIZE = Decryptor::BLOCK_SIZE;
+
+    static auto load(const std::byte* p, std::size_t size) noexcept
+        -> std::uint64_t
+    {
+        std::uint64_t value = 0;
+        for (std::size_t k = 0; k < size; ++k) {
+            value |= (std::uint64_t)p[k] << (8 * k);
+        }
+        return value;
+    }
+
+    static auto store(std::byte* p, std::size_t size, std::uint64_t value)
+        noexcept -> void
+    {
+        for (std::size_t k = 0; k < size; ++k) {
+            p[k] = (std::byte)(value >> (8 * k));
+        }
+    }
+};
+
+/*
+    Encrypts the plaintext into a container with chunks of chunkSize bytes
+    (a nonzero multiple of 16). If chunkIvs is empty, the chunks are a
+    single CBC stream starting with iv. Otherwise, it must have the IV of
+    each chunk (16 bytes each), which must be unpredictable, and iv is
+    ignored. Returns std::nullopt if the arguments are invalid.
+*/
+inline auto writeContainer(std::span<const std::byte, 16> key,
+    std::span<const std::byte, 16> iv, std::span<const std::byte> plaintext,
+    std::size_t chunkSize, std::span<const std::byte> chunkIvs = {})
+    -> std::optional<std::vector<std::byte>>
+{
+    using F = ContainerFormat;
+    if (chunkSize == 0 || chunkSize % F::BLOCK_SIZE != 0
+            || chunkSize > (std::size_t)INT_MAX - F::BLOCK_SIZE) {
+        return std::nullopt;
+    }
+    auto count = std::max((plaintext.size() + chunkSize - 1) / chunkSize,
+        (std::size_t)1);
+    auto hasIvs = !chunkIvs.empty();
+    if (hasIvs && chunkIvs.size() != count * F::BLOCK_SIZE) {
+        return std::nullopt;
+    }
+    auto indexSize = (count + 1) * 8 + (hasIvs ? count * F::BLOCK_SIZE : 0);
+    auto dataStart = F::HEADER_SIZE + indexSize;
+    auto lastSize = plaintext.size() - (count - 1) * chunkSize;
+    auto total = dataStart + (count - 1) * chunkSize
+        + (lastSize / F::BLOCK_SIZE + 1) * F::BLOCK_SIZE;
+    std::vector<std::byte> out(total);
+    auto* p = out.data();
+    std::ranges::copy(F::MAGIC, p);
+    p[8] = (std::byte)F::VERSION;
+    p[9] = (std::byte)(hasIvs ? F::CHUNK_IVS : 0);
+    F::store(p + 12, 4, chunkSize);
+    F::store(p + 16, 8, count);
+    std::ranges::copy(hasIvs ? chunkIvs.first<16>() : iv, p + 24);
+    if (hasIvs) {
+        std::ranges::copy(chunkIvs, p + F::HEADER_SIZE + (count + 1) * 8);
+    }
+
+    auto* u = reinterpret_cast<unsigned char*>(out.data());
+    auto* in = reinterpret_cast<const unsigned char*>(plaintext.data());
+    std::unique_ptr<EVP_CIPHER_CTX, decltype(&EVP_CIPHER_CTX_free)> ctx {
+        nullptr, EVP_CIPHER_CTX_free};
+    auto offset = dataStart;
+    for (std::size_t k = 0; k < count; ++k) {
+        F::store(p + F::HEADER_SIZE + 8 * k, 8, offset);
+        if (k == 0 || hasIvs) {
+            auto* chunkIv = hasIvs
+                ? chunkIvs.data() + k * F::BLOCK_SIZE
+                : iv.data();
+            ctx.reset(EVP_CIPHER_CTX_new());
+            if (ctx == nullptr
+                    || !EVP_EncryptInit_ex(ctx.get(), EVP_aes_128_cbc(),
+                        nullptr, reinterpret_cast<const unsigned char*>(
+                            key.data()),
+                        reinterpret_cast<const unsigned char*>(chunkIv))) {
+                return std::nullopt;
+            }
+        }
+        auto size = (k + 1 < count) ? chunkSize : lastSize;
+        int outl = 0;
+        int finalLength = 0;
+        if (!EVP_EncryptUpdate(ctx.get(), u + offset, &outl,
+                in + k * chunkSize, (int)size)
+                || (k + 1 == count
+                    && !EVP_EncryptFinal_ex(ctx.get(), u + offset + outl,
+                        &finalLength))) {
+            return std::nullopt;
+        }
+        offset += (std::size_t)outl + (std::size_t)finalLength;
+    }
+    F::store(p + F::HEADER_SIZE + 8 * count, 8, offset);
+    return out;
+}
+
+/*
+    Decrypts the chunks of a container in memory (e.g., a file mapped with
+    mmap(2)), which must outlive the reader. Seeking to a chunk takes O(1)
+    through the index, and the chunks are decrypted independently.
+*/
+class ContainerReader final {
+public:
+    using Format = ContainerFormat;
+
+    /*
+        Returns std::nullopt if the header or the index is broken.
+    */
+    static auto open(std::span<const std::byte> container,
+        std::span<const std::byte, 16> key) -> std::optional<ContainerReader>
+    {
+        using F = ContainerFormat;
+        if (container.size() < F::HEADER_SIZE
+                || !std::ranges::equal(container.first(8), F::MAGIC)) {
+            return std::nullopt;
+        }
+        auto* p = container.data();
+        auto flags = (std::uint8_t)p[9];
+        auto chunkSize = F::load(p + 12, 4);
+        auto count = F::load(p + 16, 8);
+        if ((std::uint8_t)p[8] != F::VERSION || (flags & ~F::CHUNK_IVS) != 0
+                || chunkSize == 0 || chunkSize % F::BLOCK_SIZE != 0
+                || chunkSize > (std::size_t)INT_MAX - F::BLOCK_SIZE
+                || count == 0 || count > container.size() / 8) {
+            return std::nullopt;
+        }
+        auto hasIvs = (flags & F::CHUNK_IVS) != 0;
+        auto ivsStart = F::HEADER_SIZE + (count + 1) * 8;
+        auto dataStart = ivsStart + (hasIvs ? count * F::BLOCK_SIZE : 0);
+        if (dataStart > container.size()) {
+            return std::nullopt;
+        }
+        std::vector<std::uint64_t> offsets(count + 1);
+        for (std::size_t k = 0; k <= count; ++k) {
+            offsets[k] = F::load(p + F::HEADER_SIZE + 8 * k, 8);
+        }
+        if (offsets[0] < dataStart || offsets[count] > container.size()) {
+            return std::nullopt;
+        }
+        for (std::size_t k = 0; k < count; ++k) {
+            if (offsets[k + 1] < offsets[k]) {
+                return std::nullopt;
+            }
+            auto length = offsets[k + 1] - offsets[k];
+            auto valid = (k + 1 < count)
+                ? length == chunkSize
+                : (length % F::BLOCK_SIZE == 0 && length >= F::BLOCK_SIZE
+                    && length <= chunkSize + F::BLOCK_SIZE);
+            if (!valid) {
+                return std::nullopt;
+            }
+        }
+        ContainerReader reader {container, (std::size_t)chunkSize,
+            std::move(offsets)};
+        std::ranges::copy(key, reader.key.begin());
+        reader.ivs = hasIvs ? p + ivsStart : nullptr;
+        return reader;
+    }
+
+    auto chunkCount() const noexcept -> std::size_t
+    {
+        return offsets.size() - 1;
+    }
+
+    auto chunkSize() const noexcept -> std::size_t
+    {
+        return chunkSize_;
+    }
+
+    /*
+        The length of the ciphertext of count chunks from first, which is
+        the room that decryptChunks() needs for the plaintext.
+    */
+    auto ciphertextLength(std::size_t first, std::size_t count) const noexcept
+        -> std::size_t
+    {
+        return (std::size_t)(offsets[first + count] - offsets[first]);
+    }
+
+    /*
+        Decrypts the chunk at index into out, which must have room for its
+        ciphertext. Returns the length of the plaintext, or std::nullopt if
+        the decryption fails. It may be called from many threads at once.
+    */
+    auto decryptChunk(std::size_t index, std::span<std::byte> out) const
+        -> std::optional<std::size_t>
+    {
+        if (index >= chunkCount()) {
+            return std::nullopt;
+        }
+        auto begin = (std::size_t)offsets[index];
+        auto in = container.subspan(begin, ciphertextLength(index, 1));
+        auto* iv = (ivs != nullptr) ? ivs + index * Format::BLOCK_SIZE
+            : (index == 0) ? container.data() + 24
+            : container.data() + begin - Format::BLOCK_SIZE;
+        auto decryptor = Decryptor::make(EVP_aes_128_cbc(), key,
+            std::span<const std::byte, 16> {iv, 16});
+        if (!decryptor) {
+            return std::nullopt;
+        }
+        auto last = (index + 1 == chunkCount());
+        decryptor->setPadding(last);
+        auto plain = decryptor->update(in, out);
+        if (!plain) {
+            return std::nullopt;
+        }
+        if (!last) {
+            return plain->size();
+        }
+        auto rest = decryptor->finish(out.subspan(plain->size()));
+        if (!rest) {
+            return std::nullopt;
+        }
+        return plain->size() + rest->size();
+    }
+
+    /*
+        Decrypts count chunks from first in parallel on the executor, and
+        blocks until all of them are done. The plaintext of each chunk is
+        written at its offset chunkSize() * (index - first) in out, which
+        must have room for ciphertextLength(first, count) bytes. Returns
+        the length of the plaintext, or std::nullopt if the decryption
+        fails. It must not be called from a thread of the executor.
+    */
+    template <Executor E>
+    auto decryptChunks(E& executor, std::size_t first, std::size_t count,
+        std::span<std::byte> out) const -> std::optional<std::size_t>
+    {
+        if (count == 0 || first > chunkCount()
+                || count > chunkCount() - first
+                || out.size() < ciphertextLength(first, count)) {
+            return std::nullopt;
+        }
+        std::latch done {(std::ptrdiff_t)count};
+        std::atomic<bool> failed {false};
+        std::size_t lastLength = 0;
+        for (std::size_t k = 0; k < count; ++k) {
+            executor.execute([&, k] {
+                auto n = decryptChunk(first + k,
+                    out.subspan(k * chunkSize_));
+                if (!n) {
+                    failed.store(true, std::memory_order_relaxed);
+                } else if (k + 1 == count) {
+                    lastLength = *n;
+                }
+                done.count_down();
+            });
+        }
+        done.wait();
+        if (failed.load(std::memory_order_relaxed)) {
+            return std::nullopt;
+        }
+        return (count - 1) * chunkSize_ + lastLength;
+    }
+
+private:
+    std::span<const std::byte> container;
+    std::size_t chunkSize_;
+    std::vector<std::uint64_t> offsets;
+    std::array<std::byte, 16> key {};
+    const std::byte* ivs = nullptr;
+
+    ContainerReader(std::span<const std::byte> container,
+        std::size_t chunkSize, std::vector<std::uint64_t>&& offsets)
+        : container {container},
+          chunkSize_ {chunkSize},
+          offsets {std::move(offsets)}
+    {
+    }
+};
+
+} // namespace mimicssl
+
+#endif
@@ -0,0 +1,217 @@
+#ifndef decryptbuf_HPP
+#define decryptbuf_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <span>
+#include <streambuf>
+#include <utility>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "chunksize.hpp"
+#include "decryptor.hpp"
+
+namespace mimicssl {
+
+/*
+    A read-only std::streambuf that decrypts the ciphertext of another
+    streambuf or a file descriptor, chunkSize() bytes at a time, as the
+    plaintext is read. The chunk size defaults to tunedChunkSize(). The end
+    of the source is the end of the ciphertext.
+    If the ciphertext is broken (e.g., its padding is invalid), reading
+    ends early and failed() returns true.
+*/
+class DecryptBuf final : public std::streambuf {
+public:
+    DecryptBuf(Decryptor&& decryptor, std::streambuf* source,
+        std::size_t chunkSize = tunedChunkSize().chunkSize)
+        : DecryptBuf {std::move(decryptor), source, -1, chunkSize}
+    {
+    }
+
+    /*
+        The file descriptor is not closed by the destructor.
+    */
+    DecryptBuf(Decryptor&& decryptor, int fd,
+        std::size_t chunkSize = tunedChunkSize().chunkSize)
+        : DecryptBuf {std::move(decryptor), nullptr, fd, chunkSize}
+    {
+    }
+
+    auto failed() const noexcept -> bool
+    {
+        return broken;
+    }
+
+    auto chunkSize() const noexcept -> std::size_t
+    {
+        return chunk;
+    }
+
+protected:
+    auto underflow() -> int_type override
+    {
+        while (gptr() == egptr()) {
+            if (done) {
+                return traits_type::eof();
+            }
+            auto plain = decryptChunk(out.get(), chunk + BLOCK_SIZE);
+            auto* p = reinterpret_cast<char*>(out.get());
+            setg(p, p, p + plain);
+        }
+        return traits_type::to_int_type(*gptr());
+    }
+
+    /*
+        Copies the plaintext already in the buffer, and then decrypts the
+        whole chunks directly into s while the rest of the request is large
+        enough.
+    */
+    auto xsgetn(char_type* s, std::streamsize n) -> std::streamsize override
+    {
+        std::streamsize total = 0;
+        while (total < n) {
+            auto available = egptr() - gptr();
+            if (available > 0) {
+                auto size = std::min(available, n - total);
+                std::memcpy(s + total, gptr(), (std::size_t)size);
+                gbump((int)size);
+                total += size;
+                continue;
+            }
+            if (done) {
+                break;
+            }
+            auto rest = (std::size_t)(n - total);
+            if (rest < chunk + BLOCK_SIZE) {
+                auto c = underflow();
+                if (traits_type::eq_int_type(c, traits_type::eof())) {
+                    break;
+                }
+                continue;
+            }
+            auto* o = reinterpret_cast<std::byte*>(s + total);
+            total += (std::streamsize)decryptChunk(o, rest);
+        }
+        return total;
+    }
+
+private:
+    static constexpr std::size_t BLOCK_SIZE = Decryptor::BLOCK_SIZE;
+    static constexpr std::size_t MAX_CHUNK_SIZE
+        = ((std::size_t)INT_MAX - BLOCK_SIZE) / BLOCK_SIZE * BLOCK_SIZE;
+    static constexpr std::align_val_t ALIGNMENT {64};
+
+    struct AlignedDelete {
+        auto operator()(std::byte* p) const noexcept -> void
+        {
+            ::operator delete[](p, ALIGNMENT);
+        }
+    };
+
+    using Buffer = std::unique_ptr<std::byte[], AlignedDelete>;
+
+    Decryptor decryptor;
+    std::streambuf* source;
+    int fd;
+    std::size_t chunk;
+    Buffer in;
+    Buffer out;
+    bool done = false;
+    bool broken = false;
+
+    /*
+        The chunk size is rounded down to a multiple of BLOCK_SIZE, and at
+        most MAX_CHUNK_SIZE, so that the plaintext of a chunk fits in the int
+        that gbump() and EVP_DecryptUpdate() take.
+    */
+    DecryptBuf(Decryptor&& decryptor, std::streambuf* source, int fd,
+        std::size_t chunkSize)
+        : decryptor {std::move(decryptor)},
+          source {source},
+          fd {fd},
+          chunk {std::clamp(chunkSize / BLOCK_SIZE * BLOCK_SIZE, BLOCK_SIZE,
+              MAX_CHUNK_SIZE)},
+          in {newBuffer(chunk)},
+          out {newBuffer(chunk + BLOCK_SIZE)}
+    {
+    }
+
+    static auto newBuffer(std::size_t size) -> Buffer
+    {
+        return Buffer {
+            static_cast<std::byte*>(::operator new[](size, ALIGNMENT))};
+    }
+
+    auto readSome(std::byte* buffer, std::size_t size) -> long long
+    {
+        if (source != nullptr) {
+            return (long long)source->sgetn(reinterpret_cast<char*>(buffer),
+                (std::streamsize)size);
+        }
+        long long n;
+        do {
+#if defined(_WIN32)
+            n = _read(fd, buffer, (unsigned int)size);
+#else
+            n = read(fd, buffer, size);
+#endif
+        } while (n < 0 && errno == EINTR);
+        return n;
+    }
+
+    /*
+        Reads a chunk of the ciphertext and decrypts it into output, which
+        must have room for chunkSize() + BLOCK_SIZE bytes. If the source
+        ends, the last block is also output. Returns the length of the
+        plaintext.
+    */
+    auto decryptChunk(std::byte* output, std::size_t room) -> std::size_t
+    {
+        std::size_t length = 0;
+        while (length < chunk) {
+            auto n = readSome(in.get() + length, chunk - length);
+            if (n <= 0) {
+                done = true;
+                broken = (n < 0);
+                break;
+            }
+            length += (std::size_t)n;
+        }
+        std::span<std::byte> o {output, room};
+        auto plain = decryptor.update(std::span {in.get(), length}, o);
+        if (!plain) {
+            return fail();
+        }
+        auto size = plain->size();
+        if (done && !broken) {
+            auto last = decryptor.finish(o.subspan(size));
+            if (!last) {
+                return fail();
+            }
+            size += last->size();
+        }
+        return size;
+    }
+
+    auto fail() -> std::size_t
+    {
+        done = true;
+        broken = true;
+        return 0;
+    }
+};
+
+} // namespace mimicssl
+
+#endif
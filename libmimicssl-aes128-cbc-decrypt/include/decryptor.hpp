@@ -0,0 +1,150 @@
+#ifndef decryptor_HPP
+#define decryptor_HPP
+
+#include <climits>
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <utility>
+
+#include "evp.h"
+
+namespace mimicssl {
+
+/*
+    A move-only owner of an EVP_CIPHER_CTX initialized for decryption. The
+    context is allocated only by make(), so update() and finish() never
+    allocate. They return the part of the output that is written, or
+    std::nullopt if the underlying EVP function fails.
+*/
+class Decryptor final {
+public:
+    static constexpr std::size_t BLOCK_SIZE = 16;
+
+    /*
+        Returns std::nullopt if the length of the key does not match the
+        cipher or the context cannot be allocated.
+    */
+    static auto make(const EVP_CIPHER* cipher,
+        std::span<const std::byte> key,
+        std::span<const std::byte, BLOCK_SIZE> iv) noexcept
+        -> std::optional<Decryptor>
+    {
+        if (key.size() != (std::size_t)EVP_CIPHER_key_length(cipher)) {
+            return std::nullopt;
+        }
+        auto* ctx = EVP_CIPHER_CTX_new();
+        if (ctx == nullptr) {
+            return std::nullopt;
+        }
+        if (!EVP_DecryptInit_ex(ctx, cipher, nullptr, toUchar(key.data()),
+                toUchar(iv.data()))) {
+            EVP_CIPHER_CTX_free(ctx);
+            return std::nullopt;
+        }
+        return Decryptor {ctx};
+    }
+
+    Decryptor(const Decryptor&) = delete;
+    auto operator=(const Decryptor&) -> Decryptor& = delete;
+
+    Decryptor(Decryptor&& other) noexcept
+        : ctx {std::exchange(other.ctx, nullptr)},
+          updated {other.updated},
+          slack {other.slack}
+    {
+    }
+
+    auto operator=(Decryptor&& other) noexcept -> Decryptor&
+    {
+        std::swap(ctx, other.ctx);
+        std::swap(updated, other.updated);
+        std::swap(slack, other.slack);
+        return *this;
+    }
+
+    ~Decryptor()
+    {
+        if (ctx != nullptr) {
+            EVP_CIPHER_CTX_free(ctx);
+        }
+    }
+
+    /*
+        The same as EVP_CIPHER_CTX_set_padding(). Once it is called after
+        update(), the next update() may also write the block that the
+        previous one held back, so update() needs another block of room.
+    */
+    auto setPadding(bool enabled) noexcept -> void
+    {
+        EVP_CIPHER_CTX_set_padding(ctx, enabled ? 1 : 0);
+        if (updated) {
+            slack = BLOCK_SIZE;
+        }
+    }
+
+    /*
+        The output must be at least as long as the input, and a block longer
+        once setPadding() has been called after update().
+    */
+    auto update(std::span<const std::byte> in, std::span<std::byte> out)
+        noexcept -> std::optional<std::span<std::byte>>
+    {
+        if (in.size() > (std::size_t)INT_MAX
+                || out.size() < in.size() + slack) {
+            return std::nullopt;
+        }
+        int outl;
+        if (!EVP_DecryptUpdate(ctx, toUchar(out.data()), &outl,
+                toUchar(in.data()), (int)in.size())) {
+            return std::nullopt;
+        }
+        updated = true;
+        return out.first((std::size_t)outl);
+    }
+
+    /*
+        The output must have room for a block.
+    */
+    auto finish(std::span<std::byte> out) noexcept
+        -> std::optional<std::span<std::byte>>
+    {
+        if (out.size() < BLOCK_SIZE) {
+            return std::nullopt;
+        }
+        int outl;
+        if (!EVP_DecryptFinal_ex(ctx, toUchar(out.data()), &outl)) {
+            return std::nullopt;
+        }
+        return out.first((std::size_t)outl);
+    }
+
+    auto native() const noexcept -> EVP_CIPHER_CTX*
+    {
+        return ctx;
+    }
+
+private:
+    EVP_CIPHER_CTX* ctx;
+    bool updated = false;
+    std::size_t slack = 0;
+
+    explicit Decryptor(EVP_CIPHER_CTX* ctx) noexcept
+        : ctx {ctx}
+    {
+    }
+
+    static auto toUchar(std::byte* p) noexcept -> unsigned char*
+    {
+        return reinterpret_cast<unsigned char*>(p);
+    }
+
+    static auto toUchar(const std::byte* p) noexcept -> const unsigned char*
+    {
+        return reinterpret_cast<const unsigned char*>(p);
+    }
+};
+
+} // namespace mimicssl
+
+#endif
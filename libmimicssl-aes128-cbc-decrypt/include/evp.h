@@ -1,11 +1,52 @@
 #ifndef evp_H
 #define evp_H
 
+#include <stddef.h>
+
 #include "evp_export.h"
 
 typedef struct EVP_CIPHER_CTX EVP_CIPHER_CTX;
 typedef struct EVP_CIPHER EVP_CIPHER;
 typedef struct ENGINE ENGINE;
+typedef struct EVP_ETM_CTX EVP_ETM_CTX;
+
+/*
+    Performance counters, available only when the library is built with
+    MIMICSSL_ENABLE_STATS=ON. Times are in nanoseconds; bookkeeping is the
+    time spent in EVP_DecryptUpdate() outside the AES kernel.
+*/
+typedef struct EVP_STATS {
+    unsigned long long bytesDecrypted;
+    unsigned long long updateCalls;
+    unsigned long long averageUpdateSize;
+    unsigned long long kernelNanoseconds;
+    unsigned long long bookkeepingNanoseconds;
+    unsigned long long keyExpansions;
+    unsigned long long allocations;
+} EVP_STATS;
+
+/*
+    A segment of a scatter/gather list. The layout is the same as that of
+    struct iovec in POSIX.
+*/
+typedef struct EVP_IOVEC {
+    void *iov_base;
+    size_t iov_len;
+} EVP_IOVEC;
+
+#define EVP_AES_128_ROUND_KEY_LENGTH 176
+
+/*
+    The length of the state that EVP_CIPHER_CTX_export_state() writes.
+*/
+#define EVP_CIPHER_CTX_STATE_LENGTH 40
+
+/*
+    Capabilities of an AES backend.
+*/
+#define EVP_AES_BACKEND_HARDWARE 0x01
+#define EVP_AES_BACKEND_SIMD 0x02
+#define EVP_AES_BACKEND_CONSTANT_TIME 0x04
 
 #if defined(__cplusplus)
 extern "C" {
@@ -14,15 +55,146 @@ extern "C" {
 EVP_CIPHER_CTX *EVP_EXPORT EVP_CIPHER_CTX_new(void);
 int EVP_EXPORT EVP_CIPHER_CTX_reset(EVP_CIPHER_CTX *c);
 void EVP_EXPORT EVP_CIPHER_CTX_free(EVP_CIPHER_CTX *c);
+int EVP_EXPORT EVP_CIPHER_CTX_set_padding(EVP_CIPHER_CTX *c, int pad);
 int EVP_EXPORT EVP_DecryptInit_ex(EVP_CIPHER_CTX *ctx,
     const EVP_CIPHER *cipher, ENGINE *impl,
     const unsigned char *key,
     const unsigned char *iv);
+
+/*
+    Same as calling EVP_DecryptInit_ex() with no engine for each of the count
+    contexts, but expands the keys in parallel for EVP_aes_128_cbc() and
+    EVP_aes_128_ecb(). iv can be NULL for the ECB mode. If it fails, none of
+    the contexts is left initialized, as if EVP_CIPHER_CTX_reset() were
+    called for each of them.
+*/
+int EVP_EXPORT EVP_DecryptInit_multi(EVP_CIPHER_CTX *const *ctx,
+    const EVP_CIPHER *cipher, const unsigned char *const *key,
+    const unsigned char *const *iv, int count);
+
+/*
+    Same as EVP_DecryptInit_ex() with no engine, but takes the round keys
+    that are already expanded (EVP_AES_128_ROUND_KEY_LENGTH bytes, those of
+    the equivalent inverse cipher in FIPS 197, 5.3.5) instead of the key, so
+    no key expansion is done. Only EVP_aes_128_cbc() and EVP_aes_128_ecb()
+    support it. roundkey.hpp computes the round keys at compile time.
+*/
+int EVP_EXPORT EVP_DecryptInit_roundkey(EVP_CIPHER_CTX *ctx,
+    const EVP_CIPHER *cipher, const unsigned char *roundKey,
+    const unsigned char *iv);
 int EVP_EXPORT EVP_DecryptUpdate(EVP_CIPHER_CTX *ctx,
     unsigned char *out, int *outl, const unsigned char *in, int inl);
 int EVP_EXPORT EVP_DecryptFinal_ex(EVP_CIPHER_CTX *ctx,
     unsigned char *outm, int *outl);
+
+/*
+    Same as EVP_DecryptUpdate() with the concatenation of the incnt input
+    segments, but writes the plaintext across the outcnt output segments in
+    order. The segments can have any length, and a block straddling their
+    boundaries is gathered internally. The output segments must have room
+    for as many bytes as the input, and for another block if
+    EVP_CIPHER_CTX_set_padding() has disabled the padding since a previous
+    update held back the last block.
+*/
+int EVP_EXPORT EVP_DecryptUpdate_iov(EVP_CIPHER_CTX *ctx,
+    const EVP_IOVEC *out, int outcnt, int *outl,
+    const EVP_IOVEC *in, int incnt);
+
+/*
+    Makes EVP_DecryptUpdate() compute the CRC32C (Castagnoli) of the
+    plaintext in the same pass as the decryption, while the plaintext is
+    still in the cache. Call it after EVP_DecryptInit_ex() and before the
+    first EVP_DecryptUpdate(). Only the CBC and ECB modes support it.
+    EVP_DecryptFinal_crc32c() is EVP_DecryptFinal_ex() that also returns the
+    checksum of the whole plaintext, excluding the padding.
+*/
+int EVP_EXPORT EVP_CIPHER_CTX_enable_crc32c(EVP_CIPHER_CTX *ctx);
+int EVP_EXPORT EVP_DecryptFinal_crc32c(EVP_CIPHER_CTX *ctx,
+    unsigned char *outm, int *outl, unsigned int *crc);
+
+/*
+    EVP_CIPHER_CTX_export_state() writes the state of a decryption context
+    that follows the key (EVP_CIPHER_CTX_STATE_LENGTH bytes: the IV or the
+    counter, the block held back for the padding or the unused key stream,
+    the flags, and the CRC32C) to out, so that a decryption interrupted
+    between EVP_DecryptUpdate() calls can be resumed later, possibly in
+    another process. EVP_CIPHER_CTX_import_state() restores it into a
+    context initialized with EVP_DecryptInit_ex() and the same cipher and
+    key (the IV is then ignored). The state contains no key but may contain
+    a block of the plaintext.
+*/
+int EVP_EXPORT EVP_CIPHER_CTX_export_state(EVP_CIPHER_CTX *ctx,
+    unsigned char *out, int *outl);
+int EVP_EXPORT EVP_CIPHER_CTX_import_state(EVP_CIPHER_CTX *ctx,
+    const unsigned char *in, int inl);
+int EVP_EXPORT EVP_EncryptInit_ex(EVP_CIPHER_CTX *ctx,
+    const EVP_CIPHER *cipher, ENGINE *impl,
+    const unsigned char *key,
+    const unsigned char *iv);
+int EVP_EXPORT EVP_EncryptUpdate(EVP_CIPHER_CTX *ctx,
+    unsigned char *out, int *outl, const unsigned char *in, int inl);
+int EVP_EXPORT EVP_EncryptFinal_ex(EVP_CIPHER_CTX *ctx,
+    unsigned char *out, int *outl);
+
+/*
+    Same as calling EVP_EncryptUpdate() for each of the count contexts, but
+    the blocks of different contexts are encrypted in parallel. Only
+    EVP_aes_128_cbc() supports the encryption.
+*/
+int EVP_EXPORT EVP_EncryptUpdate_multi(EVP_CIPHER_CTX *const *ctx,
+    unsigned char *const *out, int *outl,
+    const unsigned char *const *in, const int *inl, int count);
+
 const EVP_EXPORT EVP_CIPHER *EVP_aes_128_cbc(void);
+const EVP_EXPORT EVP_CIPHER *EVP_aes_128_ecb(void);
+const EVP_EXPORT EVP_CIPHER *EVP_aes_192_cbc(void);
+const EVP_EXPORT EVP_CIPHER *EVP_aes_256_cbc(void);
+const EVP_EXPORT EVP_CIPHER *EVP_aes_128_ctr(void);
+int EVP_EXPORT EVP_CIPHER_key_length(const EVP_CIPHER *cipher);
+int EVP_EXPORT EVP_CIPHER_CTX_get_stats(EVP_CIPHER_CTX *ctx,
+    EVP_STATS *stats, int reset);
+int EVP_EXPORT EVP_get_global_stats(EVP_STATS *stats, int reset);
+
+/*
+    Encrypt-then-MAC with AES-128-CBC and HMAC-SHA256 over the IV followed
+    by the ciphertext. EVP_ETM_DecryptUpdate() MACs each chunk of the
+    ciphertext and decrypts it while it is still in the cache.
+    EVP_ETM_DecryptFinal() verifies the tag (the leftmost 16 to 32 bytes of
+    the HMAC) in constant time and outputs the last block only if it
+    matches; otherwise the plaintext that the updates have output must be
+    discarded. EVP_ETM_decrypt() does all of them at once and zeroes the
+    output (inl bytes) unless the tag matches, so no unauthenticated
+    plaintext is released.
+*/
+EVP_ETM_CTX *EVP_EXPORT EVP_ETM_CTX_new(void);
+void EVP_EXPORT EVP_ETM_CTX_free(EVP_ETM_CTX *ctx);
+int EVP_EXPORT EVP_ETM_DecryptInit(EVP_ETM_CTX *ctx,
+    const unsigned char *key, const unsigned char *macKey, int macKeyLength,
+    const unsigned char *iv);
+int EVP_EXPORT EVP_ETM_DecryptUpdate(EVP_ETM_CTX *ctx,
+    unsigned char *out, int *outl, const unsigned char *in, int inl);
+int EVP_EXPORT EVP_ETM_DecryptFinal(EVP_ETM_CTX *ctx,
+    unsigned char *outm, int *outl, const unsigned char *tag, int tagLength);
+int EVP_EXPORT EVP_ETM_decrypt(const unsigned char *key,
+    const unsigned char *macKey, int macKeyLength, const unsigned char *iv,
+    const unsigned char *in, int inl,
+    const unsigned char *tag, int tagLength,
+    unsigned char *out, int *outl);
+
+/*
+    The AES backend is chosen when the first context is initialized: the one
+    named by the environment variable MIMICSSL_AES_BACKEND if it is compiled
+    in and supported by the CPU, otherwise the fastest supported one.
+    EVP_aes_backend_select() overrides the choice for contexts initialized
+    afterwards (NULL restores the default) and must not race with
+    EVP_DecryptInit_ex(). EVP_aes_backend_get() enumerates the backends
+    compiled in and returns NULL past the last one.
+*/
+const EVP_EXPORT char *EVP_aes_backend_name(void);
+unsigned int EVP_EXPORT EVP_aes_backend_capabilities(void);
+const EVP_EXPORT char *EVP_aes_backend_get(int index,
+    unsigned int *capabilities, int *supported);
+int EVP_EXPORT EVP_aes_backend_select(const char *name);
 
 #if defined(__cplusplus)
 }
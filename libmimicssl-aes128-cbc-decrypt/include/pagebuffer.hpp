@@ -0,0 +1,198 @@
+#ifndef pagebuffer_HPP
+#define pagebuffer_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <optional>
+#include <span>
+#include <utility>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+namespace mimicssl {
+
+/*
+    A move-only buffer of whole pages for the I/O of bulk decryption. If
+    huge pages are requested on Linux, it tries explicit huge pages
+    (MAP_HUGETLB) first, then transparent huge pages (MADV_HUGEPAGE) on a
+    range aligned to HUGE_PAGE_SIZE, and then normal pages, so that a few
+    MiB of buffers take a single TLB entry instead of hundreds whenever the
+    kernel allows. Elsewhere, it is always backed by normal pages.
+*/
+class PageBuffer final {
+public:
+    enum class Pages {
+        normal,
+        transparentHuge,
+        explicitHuge,
+    };
+
+    static constexpr std::size_t PAGE_SIZE = 4096;
+    static constexpr std::size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    /*
+        Returns std::nullopt if size is zero or the memory cannot be
+        allocated.
+    */
+    static auto make(std::size_t size, bool hugePages = false) noexcept
+        -> std::optional<PageBuffer>
+    {
+        if (size == 0) {
+            return std::nullopt;
+        }
+#if defined(__linux__)
+        if (hugePages) {
+            if (auto b = mapHuge(size)) {
+                return b;
+            }
+        }
+        auto length = roundUp(size, PAGE_SIZE);
+        auto* p = map(length, 0);
+        if (p == nullptr) {
+            return std::nullopt;
+        }
+        return PageBuffer {p, size, length, Pages::normal};
+#else
+        (void)hugePages;
+        auto length = roundUp(size, PAGE_SIZE);
+        auto* p = ::operator new(length, std::align_val_t {PAGE_SIZE},
+            std::nothrow);
+        if (p == nullptr) {
+            return std::nullopt;
+        }
+        return PageBuffer {static_cast<std::byte*>(p), size, length,
+            Pages::normal};
+#endif
+    }
+
+    PageBuffer(const PageBuffer&) = delete;
+    auto operator=(const PageBuffer&) -> PageBuffer& = delete;
+
+    PageBuffer(PageBuffer&& other) noexcept
+        : base {std::exchange(other.base, nullptr)},
+          length {other.length},
+          size_ {other.size_},
+          pages_ {other.pages_}
+    {
+    }
+
+    auto operator=(PageBuffer&& other) noexcept -> PageBuffer&
+    {
+        std::swap(base, other.base);
+        std::swap(length, other.length);
+        std::swap(size_, other.size_);
+        std::swap(pages_, other.pages_);
+        return *this;
+    }
+
+    ~PageBuffer()
+    {
+        if (base == nullptr) {
+            return;
+        }
+#if defined(__linux__)
+        munmap(base, length);
+#else
+        ::operator delete(base, std::align_val_t {PAGE_SIZE});
+#endif
+    }
+
+    auto data() const noexcept -> std::byte*
+    {
+        return base;
+    }
+
+    auto size() const noexcept -> std::size_t
+    {
+        return size_;
+    }
+
+    auto bytes() const noexcept -> std::span<std::byte>
+    {
+        return {base, size_};
+    }
+
+    /*
+        The kind of the pages that actually back the buffer. For
+        Pages::transparentHuge, the kernel has been advised to use huge
+        pages, but it may still use normal pages for some of them.
+    */
+    auto pages() const noexcept -> Pages
+    {
+        return pages_;
+    }
+
+private:
+    std::byte* base;
+    std::size_t length;
+    std::size_t size_;
+    Pages pages_;
+
+    PageBuffer(std::byte* base, std::size_t size, std::size_t length,
+        Pages pages) noexcept
+        : base {base},
+          length {length},
+          size_ {size},
+          pages_ {pages}
+    {
+    }
+
+    static constexpr auto roundUp(std::size_t size, std::size_t unit) noexcept
+        -> std::size_t
+    {
+        return (size + unit - 1) / unit * unit;
+    }
+
+#if defined(__linux__)
+    static auto map(std::size_t length, int flags) noexcept -> std::byte*
+    {
+        auto* p = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+        return (p == MAP_FAILED) ? nullptr : static_cast<std::byte*>(p);
+    }
+
+    /*
+        mmap(2) aligns only to PAGE_SIZE, so the transparent huge pages get
+        an extra huge page to trim the range to HUGE_PAGE_SIZE with.
+    */
+    static auto mapHuge(std::size_t size) noexcept
+        -> std::optional<PageBuffer>
+    {
+        auto length = roundUp(size, HUGE_PAGE_SIZE);
+#if defined(MAP_HUGETLB)
+        if (auto* p = map(length, MAP_HUGETLB)) {
+            return PageBuffer {p, size, length, Pages::explicitHuge};
+        }
+#endif
+#if defined(MADV_HUGEPAGE)
+        auto* p = map(length + HUGE_PAGE_SIZE, 0);
+        if (p == nullptr) {
+            return std::nullopt;
+        }
+        auto start = (std::uintptr_t)p;
+        auto head = roundUp(start, HUGE_PAGE_SIZE) - start;
+        if (head > 0) {
+            munmap(p, head);
+        }
+        auto tail = HUGE_PAGE_SIZE - head;
+        if (tail > 0) {
+            munmap(p + head + length, tail);
+        }
+        auto* aligned = p + head;
+        auto pages = (madvise(aligned, length, MADV_HUGEPAGE) == 0)
+            ? Pages::transparentHuge
+            : Pages::normal;
+        return PageBuffer {aligned, size, length, pages};
+#else
+        return std::nullopt;
+#endif
+    }
+#endif
+};
+
+} // namespace mimicssl
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef roundkey_HPP
+#define roundkey_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "evp.h"
+
+namespace mimicssl {
+
+/*
+    The round keys of AES-128 for EVP_DecryptInit_roundkey().
+*/
+using RoundKey = std::array<unsigned char, EVP_AES_128_ROUND_KEY_LENGTH>;
+
+namespace detail {
+
+constexpr auto xtime(std::uint8_t x) -> std::uint8_t
+{
+    return (std::uint8_t)((x << 1) ^ ((x & 0x80) ? 0x1b : 0));
+}
+
+constexpr auto multiply(std::uint8_t x, std::uint8_t y) -> std::uint8_t
+{
+    std::uint8_t product = 0;
+    for (; y != 0; y >>= 1) {
+        if (y & 1) {
+            product ^= x;
+        }
+        x = xtime(x);
+    }
+    return product;
+}
+
+constexpr auto rotateLeft(std::uint8_t x, int n) -> std::uint8_t
+{
+    return (std::uint8_t)((x << n) | (x >> (8 - n)));
+}
+
+/*
+    Walks the multiplicative group with the generator 3 and its inverse
+    at the same time, so that q is the inverse of p (FIPS 197, 5.1.1).
+*/
+constexpr auto makeSbox() -> std::array<std::uint8_t, 256>
+{
+    std::array<std::uint8_t, 256> sbox {};
+    std::uint8_t p = 1;
+    std::uint8_t q = 1;
+    do {
+        p = (std::uint8_t)(p ^ xtime(p));
+        q ^= (std::uint8_t)(q << 1);
+        q ^= (std::uint8_t)(q << 2);
+        q ^= (std::uint8_t)(q << 4);
+        if (q & 0x80) {
+            q ^= 0x09;
+        }
+        sbox[p] = (std::uint8_t)(q ^ rotateLeft(q, 1) ^ rotateLeft(q, 2)
+            ^ rotateLeft(q, 3) ^ rotateLeft(q, 4) ^ 0x63);
+    } while (p != 1);
+    sbox[0] = 0x63;
+    return sbox;
+}
+
+inline constexpr std::array<std::uint8_t, 256> SBOX = makeSbox();
+
+constexpr auto invMixColumns(RoundKey& w, std::size_t offset) -> void
+{
+    for (std::size_t c = 0; c < 4; ++c) {
+        auto* s = &w[offset + 4 * c];
+        std::uint8_t a0 = s[0];
+        std::uint8_t a1 = s[1];
+        std::uint8_t a2 = s[2];
+        std::uint8_t a3 = s[3];
+        s[0] = multiply(a0, 14) ^ multiply(a1, 11) ^ multiply(a2, 13)
+            ^ multiply(a3, 9);
+        s[1] = multiply(a0, 9) ^ multiply(a1, 14) ^ multiply(a2, 11)
+            ^ multiply(a3, 13);
+        s[2] = multiply(a0, 13) ^ multiply(a1, 9) ^ multiply(a2, 14)
+            ^ multiply(a3, 11);
+        s[3] = multiply(a0, 11) ^ multiply(a1, 13) ^ multiply(a2, 9)
+            ^ multiply(a3, 14);
+    }
+}
+
+} // namespace detail
+
+/*
+    Expands the key of AES-128 into the round keys of the equivalent
+    inverse cipher at compile time, so that a fixed key costs nothing at
+    startup:
+
+        static constexpr auto ROUND_KEY = mimicssl::expandDecryptionKey(
+            {0x2b, 0x7e, ...});
+        EVP_DecryptInit_roundkey(ctx, EVP_aes_128_cbc(), ROUND_KEY.data(),
+            iv);
+
+    Note that the round keys reveal the key as well as the key itself does.
+*/
+consteval auto expandDecryptionKey(const std::array<unsigned char, 16>& key)
+    -> RoundKey
+{
+    RoundKey w {};
+    for (std::size_t i = 0; i < 16; ++i) {
+        w[i] = key[i];
+    }
+    std::uint8_t rcon = 1;
+    for (std::size_t i = 16; i < w.size(); i += 4) {
+        std::uint8_t t[4] = {w[i - 4], w[i - 3], w[i - 2], w[i - 1]};
+        if (i % 16 == 0) {
+            std::uint8_t t0 = t[0];
+            t[0] = detail::SBOX[t[1]] ^ rcon;
+            t[1] = detail::SBOX[t[2]];
+            t[2] = detail::SBOX[t[3]];
+            t[3] = detail::SBOX[t0];
+            rcon = detail::xtime(rcon);
+        }
+        for (std::size_t j = 0; j < 4; ++j) {
+            w[i + j] = w[i + j - 16] ^ t[j];
+        }
+    }
+    for (std::size_t round = 1; round < 10; ++round) {
+        detail::invMixColumns(w, 16 * round);
+    }
+    return w;
+}
+
+} // namespace mimicssl
+
+#endif
@@ -7,23 +7,44 @@
     https://nvlpubs.nist.gov/nistpubs/FIPS/NIST.FIPS.197.pdf
 */
 
+#include <string.h>
+
 #include "Aes128Cbc.h"
 
 struct State {
     uint8_t data[16];
 };
 
+/*
+    Load and store a native 32-bit word at any alignment without type
+    punning. Compilers turn each of them into a single move.
+*/
+static inline uint32_t
+load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void
+store32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
 #include "sbox.h"
 #include "rsbox.h"
 #include "rcon.h"
-#include "multiply.h"
+#include "td.h"
+#include "ctr.h"
+#include "keySchedule.h"
 
 static void
 keyExpansion(const struct Aes128Cbc_Key *key, struct Aes128Cbc_RoundKey *out)
 {
     out->round[0] = *key;
-    uint32_t *abcd = (uint32_t *)&(out->round[0].data[12]);
-    uint32_t t = *abcd;
+    uint32_t t = load32(&out->round[0].data[12]);
 
     // prev **** **** abcd
     // next
@@ -37,13 +58,11 @@ keyExpansion(const struct Aes128Cbc_Key *key, struct Aes128Cbc_RoundKey *out)
             | (SBOX[b0] << 8)
             | (SBOX[c0] << 16)
             | (SBOX[d0] << 24);
-        const uint32_t *prev = (const uint32_t *)&out->round[round - 1];
-        uint32_t *next = (uint32_t *)&out->round[round];
-        for (uint32_t j = 0; j < 4; ++j) {
-            t ^= *prev;
-            *next = t;
-            ++next;
-            ++prev;
+        const uint8_t *prev = out->round[round - 1].data;
+        uint8_t *next = out->round[round].data;
+        for (uint32_t j = 0; j < 16; j += 4) {
+            t ^= load32(prev + j);
+            store32(next + j, t);
         }
     }
 }
@@ -53,13 +72,10 @@ addRoundKey(const struct State *state, const struct Aes128Cbc_Key *key)
 {
     struct State newState;
 
-    uint32_t *out = (uint32_t *)newState.data;
-    uint32_t *v = (uint32_t *)state->data;
-    uint32_t *r = (uint32_t *)key->data;
-    out[0] = v[0] ^ r[0];
-    out[1] = v[1] ^ r[1];
-    out[2] = v[2] ^ r[2];
-    out[3] = v[3] ^ r[3];
+    for (int i = 0; i < 16; i += 4) {
+        store32(newState.data + i,
+            load32(state->data + i) ^ load32(key->data + i));
+    }
     return newState;
 }
 
@@ -92,27 +108,47 @@ invShiftRowsSubBytes(const struct State *state)
     return newState;
 }
 
+#if defined(AES128CBC_COMPACT_TABLES)
+static inline uint32_t
+rotateLeft(uint32_t v, int n)
+{
+    return (v << n) | (v >> (32 - n));
+}
+#endif
+
+/*
+    Returns the column that InvSubBytes and InvMixColumns make of the bytes
+    a0, a1, a2, and a3 in rows 0 to 3. The compact variant rotates TD_0[]
+    in place of TD_1[], TD_2[], and TD_3[], so that the tables take 1 KiB
+    instead of 4 KiB of the L1 cache.
+*/
+static inline uint32_t
+invColumn(uint8_t a0, uint8_t a1, uint8_t a2, uint8_t a3)
+{
+#if defined(AES128CBC_COMPACT_TABLES)
+    return TD_0[a0]
+        ^ rotateLeft(TD_0[a1], 8)
+        ^ rotateLeft(TD_0[a2], 16)
+        ^ rotateLeft(TD_0[a3], 24);
+#else
+    return TD_0[a0] ^ TD_1[a1] ^ TD_2[a2] ^ TD_3[a3];
+#endif
+}
+
+/*
+    SBOX[] cancels RSBOX[] in the T-tables, so that InvMixColumns alone
+    needs no other tables.
+*/
 static struct State
 invMixColumns(const struct State *state)
 {
     struct State newState;
 
-    const uint32_t *data = (const uint32_t *)state->data;
-    uint32_t *out = (uint32_t *)newState.data;
-
-    for (int i = 0; i < 4; ++i) {
-        uint32_t v = *data;
-        uint8_t a0 = (uint8_t)v;
-        uint8_t a1 = (uint8_t)(v >> 8);
-        uint8_t a2 = (uint8_t)(v >> 16);
-        uint8_t a3 = (uint8_t)(v >> 24);
-        uint32_t b0 = MULTIPLY_0[a0];
-        uint32_t b1 = MULTIPLY_1[a1];
-        uint32_t b2 = MULTIPLY_2[a2];
-        uint32_t b3 = MULTIPLY_3[a3];
-        *out = b0 ^ b1 ^ b2 ^ b3;
-        ++data;
-        ++out;
+    for (int i = 0; i < 16; i += 4) {
+        uint32_t v = load32(state->data + i);
+        store32(newState.data + i,
+            invColumn(SBOX[(uint8_t)v], SBOX[(uint8_t)(v >> 8)],
+                SBOX[(uint8_t)(v >> 16)], SBOX[(uint8_t)(v >> 24)]));
     }
     return newState;
 }
@@ -122,39 +158,32 @@ xorWithIv(const struct State *state, const uint8_t *iv)
 {
     struct State newState;
 
-    uint32_t *o = (uint32_t *)newState.data;
-    const uint32_t *p = (const uint32_t *)state->data;
-    const uint32_t *q = (const uint32_t *)iv;
-    o[0] = p[0] ^ q[0];
-    o[1] = p[1] ^ q[1];
-    o[2] = p[2] ^ q[2];
-    o[3] = p[3] ^ q[3];
+    for (int i = 0; i < 16; i += 4) {
+        store32(newState.data + i, load32(state->data + i) ^ load32(iv + i));
+    }
     return newState;
 }
 
 static void
-postKeyExpansion(struct Aes128Cbc_RoundKey *roundKey)
+invMixRoundKeys(struct Aes128Cbc_Key *round, uint32_t rounds)
 {
-    for (int k = 1; k < 10; ++k) {
-        struct Aes128Cbc_Key *key = &roundKey->round[k];
+    for (uint32_t k = 1; k < rounds; ++k) {
+        struct Aes128Cbc_Key *key = &round[k];
         struct State state;
-        uint32_t *o = (uint32_t *)key->data;
-        uint32_t *s = (uint32_t *)state.data;
-        s[0] = o[0];
-        s[1] = o[1];
-        s[2] = o[2];
-        s[3] = o[3];
+        memcpy(state.data, key->data, 16);
         struct State newState = invMixColumns(&state);
-        uint32_t *n = (uint32_t *)newState.data;
-        o[0] = n[0];
-        o[1] = n[1];
-        o[2] = n[2];
-        o[3] = n[3];
+        memcpy(key->data, newState.data, 16);
     }
 }
 
-void
-Aes128Cbc_init(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
+static void
+postKeyExpansion(struct Aes128Cbc_RoundKey *roundKey)
+{
+    invMixRoundKeys(roundKey->round, 10);
+}
+
+static void
+cbcInit(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
     const struct Aes128Cbc_Iv *iv)
 {
     keyExpansion(key, &ctx->roundKey);
@@ -162,57 +191,278 @@ Aes128Cbc_init(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
     ctx->iv = *iv;
 }
 
+static void
+cbcInitMany(struct Aes128Cbc *const *ctx,
+    const struct Aes128Cbc_Key *key, const struct Aes128Cbc_Iv *iv,
+    size_t count)
+{
+    for (size_t j = 0; j < count; ++j) {
+        cbcInit(ctx[j], &key[j], &iv[j]);
+    }
+}
+
+/*
+    Holds the state in four columns, and combines InvShiftRows,
+    InvSubBytes, and InvMixColumns of each round but the last into the 16
+    lookups of invColumn(), where column c takes row r from column c - r.
+*/
+static inline struct State
+eqInvCipher(const struct State *state, const struct Aes128Cbc_Key *round,
+    uint32_t rounds)
+{
+    const uint8_t *p = state->data;
+    const uint8_t *k = round[rounds].data;
+    uint32_t s0 = load32(p) ^ load32(k);
+    uint32_t s1 = load32(p + 4) ^ load32(k + 4);
+    uint32_t s2 = load32(p + 8) ^ load32(k + 8);
+    uint32_t s3 = load32(p + 12) ^ load32(k + 12);
+    for (uint32_t r = rounds - 1; r > 0; --r) {
+        k = round[r].data;
+        uint32_t t0 = invColumn((uint8_t)s0, (uint8_t)(s3 >> 8),
+            (uint8_t)(s2 >> 16), (uint8_t)(s1 >> 24)) ^ load32(k);
+        uint32_t t1 = invColumn((uint8_t)s1, (uint8_t)(s0 >> 8),
+            (uint8_t)(s3 >> 16), (uint8_t)(s2 >> 24)) ^ load32(k + 4);
+        uint32_t t2 = invColumn((uint8_t)s2, (uint8_t)(s1 >> 8),
+            (uint8_t)(s0 >> 16), (uint8_t)(s3 >> 24)) ^ load32(k + 8);
+        uint32_t t3 = invColumn((uint8_t)s3, (uint8_t)(s2 >> 8),
+            (uint8_t)(s1 >> 16), (uint8_t)(s0 >> 24)) ^ load32(k + 12);
+        s0 = t0;
+        s1 = t1;
+        s2 = t2;
+        s3 = t3;
+    }
+    struct State last;
+    store32(last.data, s0);
+    store32(last.data + 4, s1);
+    store32(last.data + 8, s2);
+    store32(last.data + 12, s3);
+    last = invShiftRowsSubBytes(&last);
+    return addRoundKey(&last, &round[0]);
+}
+
+/*
+    The callers pass the number of rounds as a constant, so that each key
+    size gets its own specialized copy of this function.
+*/
+static inline void
+decryptBlocks(const struct Aes128Cbc_Key *round, uint32_t rounds,
+    uint8_t *ivData, const uint8_t *in, size_t length, uint8_t *out)
+{
+    const uint8_t *iv = ivData;
+    while (length > 0) {
+        struct State state;
+        memcpy(state.data, in, 16);
+        state = eqInvCipher(&state, round, rounds);
+        state = xorWithIv(&state, iv);
+        memcpy(out, state.data, 16);
+        iv = in;
+        in += 16;
+        out += 16;
+        length -= 16;
+    }
+    if (iv != ivData) {
+        memcpy(ivData, iv, 16);
+    }
+}
+
+static void
+cbcDecrypt(struct Aes128Cbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    decryptBlocks(ctx->roundKey.round, 10, ctx->iv.data,
+        (const uint8_t *)data, length, (uint8_t *)output);
+}
+
+static void
+ecbDecrypt(struct Aes128Cbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    const uint8_t *in = (const uint8_t *)data;
+    uint8_t *out = (uint8_t *)output;
+    while (length > 0) {
+        struct State state;
+        memcpy(state.data, in, 16);
+        state = eqInvCipher(&state, ctx->roundKey.round, 10);
+        memcpy(out, state.data, 16);
+        in += 16;
+        out += 16;
+        length -= 16;
+    }
+}
+
+static void
+wideInit(struct AesCbc *ctx, const uint8_t *key, size_t keyLength,
+    const struct Aes128Cbc_Iv *iv)
+{
+    uint32_t keyWords = (uint32_t)(keyLength / 4);
+    ctx->rounds = keyWords + 6;
+    expandKey(key, keyWords, ctx->roundKey.round, ctx->rounds);
+    invMixRoundKeys(ctx->roundKey.round, ctx->rounds);
+    ctx->iv = *iv;
+}
+
+static void
+wideDecrypt(struct AesCbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    if (ctx->rounds == 12) {
+        decryptBlocks(ctx->roundKey.round, 12, ctx->iv.data,
+            (const uint8_t *)data, length, (uint8_t *)output);
+    } else {
+        decryptBlocks(ctx->roundKey.round, 14, ctx->iv.data,
+            (const uint8_t *)data, length, (uint8_t *)output);
+    }
+}
+
+static struct State
+subBytesShiftRows(const struct State *state)
+{
+    struct State newState;
+
+    const uint8_t *s = (const uint8_t *)state->data;
+    uint8_t *o = newState.data;
+    // 0 1 2 3 4 5 6 7 8 9 A B C D E F
+    // |       |       |       |
+    // 0 5 A F 4 9 E 3 8 D 2 7 C 1 6 B
+    o[0] = SBOX[s[0]];
+    o[1] = SBOX[s[5]];
+    o[2] = SBOX[s[10]];
+    o[3] = SBOX[s[15]];
+    o[4] = SBOX[s[4]];
+    o[5] = SBOX[s[9]];
+    o[6] = SBOX[s[14]];
+    o[7] = SBOX[s[3]];
+    o[8] = SBOX[s[8]];
+    o[9] = SBOX[s[13]];
+    o[10] = SBOX[s[2]];
+    o[11] = SBOX[s[7]];
+    o[12] = SBOX[s[12]];
+    o[13] = SBOX[s[1]];
+    o[14] = SBOX[s[6]];
+    o[15] = SBOX[s[11]];
+    return newState;
+}
+
+static uint32_t
+xtime4(uint32_t v)
+{
+    return ((v & 0x7f7f7f7f) << 1) ^ (((v >> 7) & 0x01010101) * 0x1b);
+}
+
+static struct State
+mixColumns(const struct State *state)
+{
+    struct State newState;
+
+    // b[i] = 2 * a[i] + 3 * a[i + 1] + a[i + 2] + a[i + 3]
+    for (int i = 0; i < 16; i += 4) {
+        uint32_t v = load32(state->data + i);
+        uint32_t r8 = (v >> 8) | (v << 24);
+        uint32_t r16 = (v >> 16) | (v << 16);
+        uint32_t r24 = (v >> 24) | (v << 8);
+        store32(newState.data + i, xtime4(v ^ r8) ^ r8 ^ r16 ^ r24);
+    }
+    return newState;
+}
+
 static struct State
-eqInvCipher(const struct State *state, const struct Aes128Cbc_RoundKey *roundKey)
+cipher(const struct State *state, const struct Aes128Cbc_RoundKey *roundKey)
 {
-    const struct Aes128Cbc_Key *key = &roundKey->round[10];
+    const struct Aes128Cbc_Key *key = &roundKey->round[0];
     struct State newState = addRoundKey(state, key);
-    for (uint32_t round = 9; round > 0; --round) {
-        --key;
-        newState = invShiftRowsSubBytes(&newState);
-        newState = invMixColumns(&newState);
+    for (uint32_t round = 1; round < 10; ++round) {
+        ++key;
+        newState = subBytesShiftRows(&newState);
+        newState = mixColumns(&newState);
         newState = addRoundKey(&newState, key);
     }
-    --key;
-    newState = invShiftRowsSubBytes(&newState);
+    ++key;
+    newState = subBytesShiftRows(&newState);
     return addRoundKey(&newState, key);
 }
 
-void Aes128Cbc_decrypt(struct Aes128Cbc *ctx, const void *data,
+static void
+ctrInit(struct Aes128Ctr *ctx, const struct Aes128Cbc_Key *key,
+    const struct Aes128Cbc_Iv *counter)
+{
+    keyExpansion(key, &ctx->roundKey);
+    ctx->counter = *counter;
+}
+
+static void
+ctrDecrypt(struct Aes128Ctr *ctx, const void *data,
     size_t length, void *output)
 {
     const uint8_t *in = (const uint8_t *)data;
-    const uint8_t *iv = ctx->iv.data;
     uint8_t *out = (uint8_t *)output;
+    struct Ctr_Counter counter = Ctr_load(ctx->counter.data);
     while (length > 0) {
-        struct State state;
-        {
-            const uint32_t *v = (const uint32_t *)in;
-            uint32_t *o = (uint32_t *)state.data;
-            o[0] = v[0];
-            o[1] = v[1];
-            o[2] = v[2];
-            o[3] = v[3];
+        struct State keyStream[8];
+        size_t n = length / 16;
+        if (n > 8) {
+            n = 8;
         }
-        state = eqInvCipher(&state, &ctx->roundKey);
-        state = xorWithIv(&state, iv);
-        {
-            const uint32_t *v = (const uint32_t *)state.data;
-            uint32_t *o = (uint32_t *)out;
-            o[0] = v[0];
-            o[1] = v[1];
-            o[2] = v[2];
-            o[3] = v[3];
+        for (size_t k = 0; k < n; ++k) {
+            struct State block;
+            Ctr_store(&counter, block.data);
+            Ctr_increment(&counter);
+            keyStream[k] = cipher(&block, &ctx->roundKey);
         }
-        iv = in;
-        in += 16;
-        out += 16;
-        length -= 16;
+        for (size_t k = 0; k < n; ++k) {
+            for (int i = 0; i < 16; i += 4) {
+                store32(out + i,
+                    load32(in + i) ^ load32(keyStream[k].data + i));
+            }
+            in += 16;
+            out += 16;
+        }
+        length -= n * 16;
+    }
+    Ctr_store(&counter, ctx->counter.data);
+}
+
+static void
+cbcEncInit(struct Aes128CbcEnc *ctx, const struct Aes128Cbc_Key *key,
+    const struct Aes128Cbc_Iv *iv)
+{
+    keyExpansion(key, &ctx->roundKey);
+    ctx->iv = *iv;
+}
+
+static void
+cbcEncrypt(struct Aes128CbcEnc *const *ctx,
+    const uint8_t *const *data, uint8_t *const *output,
+    size_t count, size_t length)
+{
+    for (size_t j = 0; j < count; ++j) {
+        struct State state;
+        memcpy(state.data, ctx[j]->iv.data, 16);
+        for (size_t offset = 0; offset < length; offset += 16) {
+            state = xorWithIv(&state, data[j] + offset);
+            state = cipher(&state, &ctx[j]->roundKey);
+            memcpy(output[j] + offset, state.data, 16);
+        }
+        memcpy(ctx[j]->iv.data, state.data, 16);
     }
-    uint32_t *o = (uint32_t *)ctx->iv.data;
-    const uint32_t *p = (const uint32_t *)iv;
-    o[0] = p[0];
-    o[1] = p[1];
-    o[2] = p[2];
-    o[3] = p[3];
 }
+
+static int
+alwaysSupported(void)
+{
+    return 1;
+}
+
+const struct Aes128Cbc_Backend Aes128Cbc_genericBackend = {
+    .name = "generic",
+    .capabilities = 0,
+    .isSupported = alwaysSupported,
+    .init = cbcInit,
+    .decrypt = cbcDecrypt,
+    .initMany = cbcInitMany,
+    .ecbDecrypt = ecbDecrypt,
+    .ctrInit = ctrInit,
+    .ctrDecrypt = ctrDecrypt,
+    .wideInit = wideInit,
+    .wideDecrypt = wideDecrypt,
+    .encInit = cbcEncInit,
+    .encrypt = cbcEncrypt};
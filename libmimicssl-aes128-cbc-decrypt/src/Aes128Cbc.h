@@ -1,6 +1,7 @@
 #ifndef Aes128Cbc_H
 #define Aes128Cbc_H
 
+#include <stdalign.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -12,24 +13,154 @@ struct Aes128Cbc_Key {
     uint8_t data[16];
 };
 
+/*
+    The round keys start at a cache line, so that the 176 bytes of AES-128
+    span three lines rather than four, and the kernels can load them with
+    aligned loads. The contexts must be allocated with this alignment.
+*/
+#define AES128CBC_ALIGNMENT 64
+
 struct Aes128Cbc_RoundKey {
-    struct Aes128Cbc_Key round[11];
+    alignas(AES128CBC_ALIGNMENT) struct Aes128Cbc_Key round[11];
 };
 
+struct Aes128Cbc_Backend;
+
 struct Aes128Cbc {
     struct Aes128Cbc_RoundKey roundKey;
     struct Aes128Cbc_Iv iv;
+    const struct Aes128Cbc_Backend *backend;
+};
+
+/*
+    AES-192 and AES-256 have 12 and 14 rounds, respectively. The round keys
+    have the same layout as those of AES-128, followed by the extra ones.
+*/
+struct AesCbc_RoundKey {
+    alignas(AES128CBC_ALIGNMENT) struct Aes128Cbc_Key round[15];
+};
+
+struct AesCbc {
+    struct AesCbc_RoundKey roundKey;
+    struct Aes128Cbc_Iv iv;
+    uint32_t rounds;
+    const struct Aes128Cbc_Backend *backend;
+};
+
+/*
+    The CTR mode uses the round keys of the (forward) cipher as they are.
+*/
+struct Aes128Ctr {
+    struct Aes128Cbc_RoundKey roundKey;
+    struct Aes128Cbc_Iv counter;
+    const struct Aes128Cbc_Backend *backend;
+};
+
+/*
+    The CBC encryption also uses the round keys of the cipher as they are.
+    The IV is the last ciphertext block.
+*/
+struct Aes128CbcEnc {
+    struct Aes128Cbc_RoundKey roundKey;
+    struct Aes128Cbc_Iv iv;
+    const struct Aes128Cbc_Backend *backend;
+};
+
+/*
+    The maximum number of streams (or keys) that a backend processes at a
+    time.
+*/
+#define AES128CBC_LANES 8
+
+/*
+    Capabilities of a backend. The values are the same as those of
+    EVP_AES_BACKEND_* in evp.h.
+*/
+enum {
+    Aes128Cbc_HARDWARE = 0x01,
+    Aes128Cbc_SIMD = 0x02,
+    Aes128Cbc_CONSTANT_TIME = 0x04,
+};
+
+/*
+    An implementation of the AES kernels. Every backend uses the same layout
+    of the round keys (those of the equivalent inverse cipher for the CBC
+    mode), so contexts are interchangeable between backends. The length of
+    ctrDecrypt() must be a multiple of 16; it is also the encryption.
+    ecbDecrypt() uses the round keys of the context that init() sets up and
+    ignores its IV.
+    wideInit() and wideDecrypt() are for AES-192 and AES-256; the length of
+    the key is 24 or 32 bytes. encrypt() encrypts count (at most
+    AES128CBC_LANES) streams of the same length in lockstep, and initMany()
+    is init() for count (at most AES128CBC_LANES) contexts.
+*/
+struct Aes128Cbc_Backend {
+    const char *name;
+    uint32_t capabilities;
+    int (*isSupported)(void);
+    void (*init)(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
+        const struct Aes128Cbc_Iv *iv);
+    void (*decrypt)(struct Aes128Cbc *ctx, const void *data,
+        size_t length, void *output);
+    void (*initMany)(struct Aes128Cbc *const *ctx,
+        const struct Aes128Cbc_Key *key, const struct Aes128Cbc_Iv *iv,
+        size_t count);
+    void (*ecbDecrypt)(struct Aes128Cbc *ctx, const void *data,
+        size_t length, void *output);
+    void (*ctrInit)(struct Aes128Ctr *ctx, const struct Aes128Cbc_Key *key,
+        const struct Aes128Cbc_Iv *counter);
+    void (*ctrDecrypt)(struct Aes128Ctr *ctx, const void *data,
+        size_t length, void *output);
+    void (*wideInit)(struct AesCbc *ctx, const uint8_t *key,
+        size_t keyLength, const struct Aes128Cbc_Iv *iv);
+    void (*wideDecrypt)(struct AesCbc *ctx, const void *data,
+        size_t length, void *output);
+    void (*encInit)(struct Aes128CbcEnc *ctx, const struct Aes128Cbc_Key *key,
+        const struct Aes128Cbc_Iv *iv);
+    void (*encrypt)(struct Aes128CbcEnc *const *ctx,
+        const uint8_t *const *data, uint8_t *const *output,
+        size_t count, size_t length);
 };
 
 #if defined(__cplusplus)
 extern "C" {
 #endif
 
+extern const struct Aes128Cbc_Backend Aes128Cbc_genericBackend;
+extern const struct Aes128Cbc_Backend Aes128Cbc_neonBackend;
+extern const struct Aes128Cbc_Backend Aes128Cbc_aesniBackend;
+extern const struct Aes128Cbc_Backend Aes128Cbc_armv8Backend;
+
+const struct Aes128Cbc_Backend *Aes128Cbc_getBackend(void);
+const struct Aes128Cbc_Backend *Aes128Cbc_getBackendAt(size_t index);
+int Aes128Cbc_selectBackend(const char *name);
+
 void Aes128Cbc_init(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
     const struct Aes128Cbc_Iv *iv);
 void Aes128Cbc_decrypt(struct Aes128Cbc *ctx, const void *data,
     size_t length, void *output);
-    
+void Aes128Cbc_initMany(struct Aes128Cbc *const *ctx,
+    const struct Aes128Cbc_Key *key, const struct Aes128Cbc_Iv *iv,
+    size_t count);
+void Aes128Cbc_initRoundKey(struct Aes128Cbc *ctx,
+    const struct Aes128Cbc_RoundKey *roundKey,
+    const struct Aes128Cbc_Iv *iv);
+void Aes128Ecb_decrypt(struct Aes128Cbc *ctx, const void *data,
+    size_t length, void *output);
+void Aes128Ctr_init(struct Aes128Ctr *ctx, const struct Aes128Cbc_Key *key,
+    const struct Aes128Cbc_Iv *counter);
+void Aes128Ctr_decrypt(struct Aes128Ctr *ctx, const void *data,
+    size_t length, void *output);
+void AesCbc_init(struct AesCbc *ctx, const uint8_t *key, size_t keyLength,
+    const struct Aes128Cbc_Iv *iv);
+void AesCbc_decrypt(struct AesCbc *ctx, const void *data,
+    size_t length, void *output);
+void Aes128CbcEnc_init(struct Aes128CbcEnc *ctx,
+    const struct Aes128Cbc_Key *key, const struct Aes128Cbc_Iv *iv);
+void Aes128CbcEnc_encrypt(struct Aes128CbcEnc *const *ctx,
+    const uint8_t *const *data, uint8_t *const *output,
+    const size_t *length, size_t count);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -14,10 +14,13 @@
 */
 
 #include <arm_neon.h>
+#include <string.h>
 #include "Aes128Cbc.h"
 
 #include "sbox.h"
 #include "rcon.h"
+#include "ctr.h"
+#include "keySchedule.h"
 
 static void
 keyExpansion(const struct Aes128Cbc_Key *key, struct Aes128Cbc_RoundKey *out)
@@ -50,17 +53,22 @@ keyExpansion(const struct Aes128Cbc_Key *key, struct Aes128Cbc_RoundKey *out)
 }
 
 static void
-postKeyExpansion(struct Aes128Cbc_RoundKey *roundKey)
+invMixRoundKeys(struct Aes128Cbc_Key *round, uint32_t rounds)
 {
-    for (int k = 1; k < 10; ++k) {
-        struct Aes128Cbc_Key *key = &roundKey->round[k];
-        uint8x16_t key128 = vaesimcq_u8(vld1q_u8(key->data));
-        vst1q_u8(key->data, key128);
+    for (uint32_t k = 1; k < rounds; ++k) {
+        uint8x16_t key128 = vaesimcq_u8(vld1q_u8(round[k].data));
+        vst1q_u8(round[k].data, key128);
     }
 }
 
-void
-Aes128Cbc_init(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
+static void
+postKeyExpansion(struct Aes128Cbc_RoundKey *roundKey)
+{
+    invMixRoundKeys(roundKey->round, 10);
+}
+
+static void
+cbcInit(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
     const struct Aes128Cbc_Iv *iv)
 {
     keyExpansion(key, &ctx->roundKey);
@@ -68,32 +76,385 @@ Aes128Cbc_init(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
     ctx->iv = *iv;
 }
 
+/*
+    Load and store a native 32-bit word without type punning.
+*/
+static inline uint32_t
+load32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void
+store32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+/*
+    Expands the keys with AESE instead of the S-box table: AESE with the
+    zero key is SubBytes after ShiftRows, and ShiftRows does nothing when
+    all the columns are the same word. The keys are independent of each
+    other, so their rounds are interleaved.
+*/
+static void
+cbcInitMany(struct Aes128Cbc *const *ctx,
+    const struct Aes128Cbc_Key *key, const struct Aes128Cbc_Iv *iv,
+    size_t count)
+{
+    uint8x16_t zero = vdupq_n_u8(0);
+    for (size_t j = 0; j < count; ++j) {
+        ctx[j]->roundKey.round[0] = key[j];
+        ctx[j]->iv = iv[j];
+    }
+    for (uint32_t round = 1; round < 11; ++round) {
+        for (size_t j = 0; j < count; ++j) {
+            const uint8_t *prev = ctx[j]->roundKey.round[round - 1].data;
+            uint8_t *next = ctx[j]->roundKey.round[round].data;
+            uint8x16_t v = vreinterpretq_u8_u32(vdupq_n_u32(
+                load32(prev + 12)));
+            uint32_t t = vgetq_lane_u32(
+                vreinterpretq_u32_u8(vaeseq_u8(v, zero)), 0);
+            t = ((t >> 8) | (t << 24)) ^ RCON[round - 1];
+            for (int k = 0; k < 16; k += 4) {
+                t ^= load32(prev + k);
+                store32(next + k, t);
+            }
+        }
+    }
+    for (size_t j = 0; j < count; ++j) {
+        postKeyExpansion(&ctx[j]->roundKey);
+    }
+}
+
+/*
+    How far ahead the input is prefetched, in bytes. The hardware
+    prefetchers do not cross page boundaries, so this keeps the next page
+    coming while the current one is decrypted.
+*/
+#define PREFETCH_DISTANCE 512
+
+static inline void
+prefetchInput(const uint8_t *in, size_t length)
+{
+    if (length >= 128 + PREFETCH_DISTANCE) {
+        __builtin_prefetch(in + PREFETCH_DISTANCE);
+        __builtin_prefetch(in + PREFETCH_DISTANCE + 64);
+    }
+}
+
+/*
+    Loads the round keys once per call. With the number of rounds constant,
+    they stay in the registers for the whole call.
+*/
+static inline void
+loadRoundKeys(uint8x16_t *key, const struct Aes128Cbc_Key *round,
+    uint32_t rounds)
+{
+    for (uint32_t k = 0; k <= rounds; ++k) {
+        key[k] = vld1q_u8(round[k].data);
+    }
+}
+
+static inline uint8x16_t
+decryptBlock(uint8x16_t state, const uint8x16_t *key, uint32_t rounds)
+{
+    for (uint32_t k = rounds; k > 1; --k) {
+        state = vaesimcq_u8(vaesdq_u8(state, key[k]));
+    }
+    return veorq_u8(vaesdq_u8(state, key[1]), key[0]);
+}
+
+/*
+    Decrypts a single block. The kernels below load the round keys once
+    per call instead.
+*/
+static inline uint8x16_t
+eqInvCipher(uint8x16_t state, const struct Aes128Cbc_Key *round,
+    uint32_t rounds)
+{
+    uint8x16_t key[15];
+    loadRoundKeys(key, round, rounds);
+    return decryptBlock(state, key, rounds);
+}
+
+/*
+    Decrypts 8 blocks at a time; unlike encryption, the CBC decryption of
+    the blocks is independent of each other. The callers pass the number of
+    rounds as a constant, so that each key size gets its own specialized
+    copy of this function.
+*/
+static inline void
+decryptBlocks(const struct Aes128Cbc_Key *round, uint32_t rounds,
+    uint8_t *iv, const uint8_t *in, size_t length, uint8_t *out)
+{
+    uint8x16_t key[15];
+    loadRoundKeys(key, round, rounds);
+    uint8x16_t iv128 = vld1q_u8(iv);
+    while (length >= 128) {
+        uint8x16_t c[8];
+        uint8x16_t s[8];
+        prefetchInput(in, length);
+        for (int j = 0; j < 8; ++j) {
+            c[j] = vld1q_u8(in + j * 16);
+            s[j] = c[j];
+        }
+        for (uint32_t k = rounds; k > 1; --k) {
+            for (int j = 0; j < 8; ++j) {
+                s[j] = vaesimcq_u8(vaesdq_u8(s[j], key[k]));
+            }
+        }
+        vst1q_u8(out, veorq_u8(veorq_u8(vaesdq_u8(s[0], key[1]), key[0]),
+            iv128));
+        for (int j = 1; j < 8; ++j) {
+            uint8x16_t state = veorq_u8(vaesdq_u8(s[j], key[1]), key[0]);
+            vst1q_u8(out + j * 16, veorq_u8(state, c[j - 1]));
+        }
+        iv128 = c[7];
+        in += 128;
+        out += 128;
+        length -= 128;
+    }
+    while (length > 0) {
+        uint8x16_t in128 = vld1q_u8(in);
+        uint8x16_t state = decryptBlock(in128, key, rounds);
+        vst1q_u8(out, veorq_u8(state, iv128));
+        iv128 = in128;
+        in += 16;
+        out += 16;
+        length -= 16;
+    }
+    vst1q_u8(iv, iv128);
+}
+
+static void
+cbcDecrypt(struct Aes128Cbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    decryptBlocks(ctx->roundKey.round, 10, ctx->iv.data,
+        (const uint8_t *)data, length, (uint8_t *)output);
+}
+
+/*
+    Decrypts 8 blocks at a time, like decryptBlocks() but without chaining.
+*/
+static void
+ecbDecrypt(struct Aes128Cbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    const uint8_t *in = (const uint8_t *)data;
+    uint8_t *out = (uint8_t *)output;
+    uint8x16_t key[11];
+    loadRoundKeys(key, ctx->roundKey.round, 10);
+    while (length >= 128) {
+        uint8x16_t s[8];
+        prefetchInput(in, length);
+        for (int j = 0; j < 8; ++j) {
+            s[j] = vld1q_u8(in + j * 16);
+        }
+        for (uint32_t k = 10; k > 1; --k) {
+            for (int j = 0; j < 8; ++j) {
+                s[j] = vaesimcq_u8(vaesdq_u8(s[j], key[k]));
+            }
+        }
+        for (int j = 0; j < 8; ++j) {
+            vst1q_u8(out + j * 16, veorq_u8(vaesdq_u8(s[j], key[1]), key[0]));
+        }
+        in += 128;
+        out += 128;
+        length -= 128;
+    }
+    while (length > 0) {
+        vst1q_u8(out, decryptBlock(vld1q_u8(in), key, 10));
+        in += 16;
+        out += 16;
+        length -= 16;
+    }
+}
+
+static void
+wideInit(struct AesCbc *ctx, const uint8_t *key, size_t keyLength,
+    const struct Aes128Cbc_Iv *iv)
+{
+    uint32_t keyWords = (uint32_t)(keyLength / 4);
+    ctx->rounds = keyWords + 6;
+    expandKey(key, keyWords, ctx->roundKey.round, ctx->rounds);
+    invMixRoundKeys(ctx->roundKey.round, ctx->rounds);
+    ctx->iv = *iv;
+}
+
+static void
+wideDecrypt(struct AesCbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    if (ctx->rounds == 12) {
+        decryptBlocks(ctx->roundKey.round, 12, ctx->iv.data,
+            (const uint8_t *)data, length, (uint8_t *)output);
+    } else {
+        decryptBlocks(ctx->roundKey.round, 14, ctx->iv.data,
+            (const uint8_t *)data, length, (uint8_t *)output);
+    }
+}
+
+static void
+ctrInit(struct Aes128Ctr *ctx, const struct Aes128Cbc_Key *key,
+    const struct Aes128Cbc_Iv *counter)
+{
+    keyExpansion(key, &ctx->roundKey);
+    ctx->counter = *counter;
+}
+
 static uint8x16_t
-eqInvCipher(uint8x16_t state, const struct Aes128Cbc_RoundKey *roundKey)
+toCounterBlock(const struct Ctr_Counter *c)
 {
-    const struct Aes128Cbc_Key *round = roundKey->round;
-    for (uint32_t k = 10; k > 1; --k) {
-        state = vaesimcq_u8(vaesdq_u8(state, vld1q_u8(round[k].data)));
+    uint64x2_t v = vcombine_u64(vcreate_u64(c->high), vcreate_u64(c->low));
+    return vrev64q_u8(vreinterpretq_u8_u64(v));
+}
+
+static inline uint8x16_t
+encryptBlock(uint8x16_t state, const uint8x16_t *key)
+{
+    for (uint32_t k = 0; k < 9; ++k) {
+        state = vaesmcq_u8(vaeseq_u8(state, key[k]));
     }
-    state = vaesdq_u8(state, vld1q_u8(round[1].data));
-    state = veorq_u8(state, vld1q_u8(round[0].data));
-    return state;
+    return veorq_u8(vaeseq_u8(state, key[9]), key[10]);
 }
 
-void Aes128Cbc_decrypt(struct Aes128Cbc *ctx, const void *data,
+/*
+    Encrypts 8 counter blocks at a time so that the independent AESE/AESMC
+    pairs fill the pipeline of the AES unit.
+*/
+static void
+ctrDecrypt(struct Aes128Ctr *ctx, const void *data,
     size_t length, void *output)
 {
     const uint8_t *in = (const uint8_t *)data;
     uint8_t *out = (uint8_t *)output;
-    uint8x16_t iv128 = vld1q_u8(ctx->iv.data);
+    struct Ctr_Counter counter = Ctr_load(ctx->counter.data);
+    uint8x16_t key[11];
+    loadRoundKeys(key, ctx->roundKey.round, 10);
+    while (length >= 128) {
+        uint8x16_t s[8];
+        prefetchInput(in, length);
+        for (int j = 0; j < 8; ++j) {
+            s[j] = toCounterBlock(&counter);
+            Ctr_increment(&counter);
+        }
+        for (uint32_t k = 0; k < 9; ++k) {
+            for (int j = 0; j < 8; ++j) {
+                s[j] = vaesmcq_u8(vaeseq_u8(s[j], key[k]));
+            }
+        }
+        for (int j = 0; j < 8; ++j) {
+            s[j] = veorq_u8(vaeseq_u8(s[j], key[9]), key[10]);
+        }
+        for (int j = 0; j < 8; ++j) {
+            uint8x16_t in128 = vld1q_u8(in + j * 16);
+            vst1q_u8(out + j * 16, veorq_u8(in128, s[j]));
+        }
+        in += 128;
+        out += 128;
+        length -= 128;
+    }
     while (length > 0) {
-        uint8x16_t in128 = vld1q_u8(in);
-        uint8x16_t state = eqInvCipher(in128, &ctx->roundKey);
-        vst1q_u8(out, veorq_u8(state, iv128));
-        iv128 = in128;
+        uint8x16_t state = encryptBlock(toCounterBlock(&counter), key);
+        Ctr_increment(&counter);
+        vst1q_u8(out, veorq_u8(vld1q_u8(in), state));
         in += 16;
         out += 16;
         length -= 16;
     }
-    vst1q_u8(ctx->iv.data, iv128);
+    Ctr_store(&counter, ctx->counter.data);
 }
+
+static void
+cbcEncInit(struct Aes128CbcEnc *ctx, const struct Aes128Cbc_Key *key,
+    const struct Aes128Cbc_Iv *iv)
+{
+    keyExpansion(key, &ctx->roundKey);
+    ctx->iv = *iv;
+}
+
+/*
+    A single stream is serial, so its round keys are loaded once and kept
+    in the registers. The lanes of different streams have their own round
+    keys, which do not fit in the registers together.
+*/
+static void
+cbcEncryptSingle(struct Aes128CbcEnc *ctx, const uint8_t *in, uint8_t *out,
+    size_t length)
+{
+    uint8x16_t key[11];
+    loadRoundKeys(key, ctx->roundKey.round, 10);
+    uint8x16_t state = vld1q_u8(ctx->iv.data);
+    for (size_t offset = 0; offset < length; offset += 16) {
+        state = encryptBlock(veorq_u8(state, vld1q_u8(in + offset)), key);
+        vst1q_u8(out + offset, state);
+    }
+    vst1q_u8(ctx->iv.data, state);
+}
+
+/*
+    The CBC encryption of a stream is serial, but the AESE/AESMC pairs of
+    different streams are independent of each other, so this encrypts up to
+    8 streams in lockstep to fill the pipeline of the AES unit.
+*/
+static void
+cbcEncrypt(struct Aes128CbcEnc *const *ctx,
+    const uint8_t *const *data, uint8_t *const *output,
+    size_t count, size_t length)
+{
+    if (count == 1) {
+        cbcEncryptSingle(ctx[0], data[0], output[0], length);
+        return;
+    }
+    const struct Aes128Cbc_Key *round[AES128CBC_LANES];
+    uint8x16_t s[AES128CBC_LANES];
+    for (size_t j = 0; j < count; ++j) {
+        round[j] = ctx[j]->roundKey.round;
+        s[j] = vld1q_u8(ctx[j]->iv.data);
+    }
+    for (size_t offset = 0; offset < length; offset += 16) {
+        for (size_t j = 0; j < count; ++j) {
+            s[j] = veorq_u8(s[j], vld1q_u8(data[j] + offset));
+        }
+        for (uint32_t k = 0; k < 9; ++k) {
+            for (size_t j = 0; j < count; ++j) {
+                s[j] = vaesmcq_u8(vaeseq_u8(s[j], vld1q_u8(round[j][k].data)));
+            }
+        }
+        for (size_t j = 0; j < count; ++j) {
+            s[j] = vaeseq_u8(s[j], vld1q_u8(round[j][9].data));
+            s[j] = veorq_u8(s[j], vld1q_u8(round[j][10].data));
+            vst1q_u8(output[j] + offset, s[j]);
+        }
+    }
+    for (size_t j = 0; j < count; ++j) {
+        vst1q_u8(ctx[j]->iv.data, s[j]);
+    }
+}
+
+static int
+alwaysSupported(void)
+{
+    return 1;
+}
+
+const struct Aes128Cbc_Backend Aes128Cbc_armv8Backend = {
+    .name = "armv8-ce",
+    .capabilities = Aes128Cbc_HARDWARE
+        | Aes128Cbc_SIMD
+        | Aes128Cbc_CONSTANT_TIME,
+    .isSupported = alwaysSupported,
+    .init = cbcInit,
+    .decrypt = cbcDecrypt,
+    .initMany = cbcInitMany,
+    .ecbDecrypt = ecbDecrypt,
+    .ctrInit = ctrInit,
+    .ctrDecrypt = ctrDecrypt,
+    .wideInit = wideInit,
+    .wideDecrypt = wideDecrypt,
+    .encInit = cbcEncInit,
+    .encrypt = cbcEncrypt};
@@ -20,6 +20,8 @@
 #include "rsbox.h"
 #include "rcon.h"
 #include "multiply.h"
+#include "ctr.h"
+#include "keySchedule.h"
 
 static void
 keyExpansion(const struct Aes128Cbc_Key *key, struct Aes128Cbc_RoundKey *out)
@@ -100,6 +102,35 @@ invMixColumns(uint8x16_t state)
     v[3] = MULTIPLY_0[s[12]];
     uint8x16_t a = vld1q_u8((uint8_t *)v);
 
+#if defined(AES128CBC_COMPACT_TABLES)
+    /*
+        MULTIPLY_1[] to MULTIPLY_3[] are MULTIPLY_0[] rotated left by 8,
+        16, and 24 bits, so rotate each lane instead of looking them up.
+    */
+    v[0] = MULTIPLY_0[s[1]];
+    v[1] = MULTIPLY_0[s[5]];
+    v[2] = MULTIPLY_0[s[9]];
+    v[3] = MULTIPLY_0[s[13]];
+    uint32x4_t w = vld1q_u32(v);
+    uint8x16_t b = vreinterpretq_u8_u32(
+        vorrq_u32(vshlq_n_u32(w, 8), vshrq_n_u32(w, 24)));
+
+    v[0] = MULTIPLY_0[s[2]];
+    v[1] = MULTIPLY_0[s[6]];
+    v[2] = MULTIPLY_0[s[10]];
+    v[3] = MULTIPLY_0[s[14]];
+    w = vld1q_u32(v);
+    uint8x16_t c = vreinterpretq_u8_u32(
+        vorrq_u32(vshlq_n_u32(w, 16), vshrq_n_u32(w, 16)));
+
+    v[0] = MULTIPLY_0[s[3]];
+    v[1] = MULTIPLY_0[s[7]];
+    v[2] = MULTIPLY_0[s[11]];
+    v[3] = MULTIPLY_0[s[15]];
+    w = vld1q_u32(v);
+    uint8x16_t d = vreinterpretq_u8_u32(
+        vorrq_u32(vshlq_n_u32(w, 24), vshrq_n_u32(w, 8)));
+#else
     v[0] = MULTIPLY_1[s[1]];
     v[1] = MULTIPLY_1[s[5]];
     v[2] = MULTIPLY_1[s[9]];
@@ -117,22 +148,28 @@ invMixColumns(uint8x16_t state)
     v[2] = MULTIPLY_3[s[11]];
     v[3] = MULTIPLY_3[s[15]];
     uint8x16_t d = vld1q_u8((uint8_t *)v);
+#endif
 
     return veorq_u8(veorq_u8(a, b), veorq_u8(c, d));
 }
 
 static void
-postKeyExpansion(struct Aes128Cbc_RoundKey *roundKey)
+invMixRoundKeys(struct Aes128Cbc_Key *round, uint32_t rounds)
 {
-    for (int k = 1; k < 10; ++k) {
-        struct Aes128Cbc_Key *key = &roundKey->round[k];
-        uint8x16_t o = vld1q_u8(key->data);
-        vst1q_u8(key->data, invMixColumns(o));
+    for (uint32_t k = 1; k < rounds; ++k) {
+        uint8x16_t o = vld1q_u8(round[k].data);
+        vst1q_u8(round[k].data, invMixColumns(o));
     }
 }
 
-void
-Aes128Cbc_init(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
+static void
+postKeyExpansion(struct Aes128Cbc_RoundKey *roundKey)
+{
+    invMixRoundKeys(roundKey->round, 10);
+}
+
+static void
+cbcInit(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
     const struct Aes128Cbc_Iv *iv)
 {
     keyExpansion(key, &ctx->roundKey);
@@ -140,12 +177,23 @@ Aes128Cbc_init(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
     ctx->iv = *iv;
 }
 
-static uint8x16_t
-eqInvCipher(uint8x16_t state, const struct Aes128Cbc_RoundKey *roundKey)
+static void
+cbcInitMany(struct Aes128Cbc *const *ctx,
+    const struct Aes128Cbc_Key *key, const struct Aes128Cbc_Iv *iv,
+    size_t count)
+{
+    for (size_t j = 0; j < count; ++j) {
+        cbcInit(ctx[j], &key[j], &iv[j]);
+    }
+}
+
+static inline uint8x16_t
+eqInvCipher(uint8x16_t state, const struct Aes128Cbc_Key *round,
+    uint32_t rounds)
 {
-    const struct Aes128Cbc_Key *key = &roundKey->round[10];
+    const struct Aes128Cbc_Key *key = &round[rounds];
     uint8x16_t newState = addRoundKey(state, key);
-    for (uint32_t round = 9; round > 0; --round) {
+    for (uint32_t k = rounds - 1; k > 0; --k) {
         --key;
         newState = invShiftRowsSubBytes(newState);
         newState = invMixColumns(newState);
@@ -156,20 +204,224 @@ eqInvCipher(uint8x16_t state, const struct Aes128Cbc_RoundKey *roundKey)
     return addRoundKey(newState, key);
 }
 
-void Aes128Cbc_decrypt(struct Aes128Cbc *ctx, const void *data,
-    size_t length, void *output)
+/*
+    The callers pass the number of rounds as a constant, so that each key
+    size gets its own specialized copy of this function.
+*/
+static inline void
+decryptBlocks(const struct Aes128Cbc_Key *round, uint32_t rounds,
+    uint8_t *iv, const uint8_t *in, size_t length, uint8_t *out)
 {
-    const uint8_t *in = (const uint8_t *)data;
-    uint8_t *out = (uint8_t *)output;
-    uint8x16_t iv128 = vld1q_u8(ctx->iv.data);
+    uint8x16_t iv128 = vld1q_u8(iv);
     while (length > 0) {
         uint8x16_t in128 = vld1q_u8(in);
-        uint8x16_t state = eqInvCipher(in128, &ctx->roundKey);
+        uint8x16_t state = eqInvCipher(in128, round, rounds);
         vst1q_u8(out, veorq_u8(state, iv128));
         iv128 = in128;
         in += 16;
         out += 16;
         length -= 16;
     }
-    vst1q_u8(ctx->iv.data, iv128);
+    vst1q_u8(iv, iv128);
+}
+
+static void
+cbcDecrypt(struct Aes128Cbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    decryptBlocks(ctx->roundKey.round, 10, ctx->iv.data,
+        (const uint8_t *)data, length, (uint8_t *)output);
+}
+
+static void
+ecbDecrypt(struct Aes128Cbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    const uint8_t *in = (const uint8_t *)data;
+    uint8_t *out = (uint8_t *)output;
+    while (length > 0) {
+        vst1q_u8(out, eqInvCipher(vld1q_u8(in), ctx->roundKey.round, 10));
+        in += 16;
+        out += 16;
+        length -= 16;
+    }
+}
+
+static void
+wideInit(struct AesCbc *ctx, const uint8_t *key, size_t keyLength,
+    const struct Aes128Cbc_Iv *iv)
+{
+    uint32_t keyWords = (uint32_t)(keyLength / 4);
+    ctx->rounds = keyWords + 6;
+    expandKey(key, keyWords, ctx->roundKey.round, ctx->rounds);
+    invMixRoundKeys(ctx->roundKey.round, ctx->rounds);
+    ctx->iv = *iv;
+}
+
+static void
+wideDecrypt(struct AesCbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    if (ctx->rounds == 12) {
+        decryptBlocks(ctx->roundKey.round, 12, ctx->iv.data,
+            (const uint8_t *)data, length, (uint8_t *)output);
+    } else {
+        decryptBlocks(ctx->roundKey.round, 14, ctx->iv.data,
+            (const uint8_t *)data, length, (uint8_t *)output);
+    }
+}
+
+static uint8x16_t
+subBytesShiftRows(uint8x16_t state)
+{
+    uint8_t s[16];
+    uint8_t o[16];
+
+    // 0 1 2 3 4 5 6 7 8 9 A B C D E F
+    // |       |       |       |
+    // 0 5 A F 4 9 E 3 8 D 2 7 C 1 6 B
+    vst1q_u8(s, state);
+    o[0] = SBOX[s[0]];
+    o[1] = SBOX[s[5]];
+    o[2] = SBOX[s[10]];
+    o[3] = SBOX[s[15]];
+    o[4] = SBOX[s[4]];
+    o[5] = SBOX[s[9]];
+    o[6] = SBOX[s[14]];
+    o[7] = SBOX[s[3]];
+    o[8] = SBOX[s[8]];
+    o[9] = SBOX[s[13]];
+    o[10] = SBOX[s[2]];
+    o[11] = SBOX[s[7]];
+    o[12] = SBOX[s[12]];
+    o[13] = SBOX[s[1]];
+    o[14] = SBOX[s[6]];
+    o[15] = SBOX[s[11]];
+    return vld1q_u8(o);
+}
+
+static uint8x16_t
+xtime(uint8x16_t state)
+{
+    int8x16_t sign = vshrq_n_s8(vreinterpretq_s8_u8(state), 7);
+    uint8x16_t carry = vandq_u8(vreinterpretq_u8_s8(sign), vdupq_n_u8(0x1b));
+    return veorq_u8(vshlq_n_u8(state, 1), carry);
+}
+
+static uint8x16_t
+mixColumns(uint8x16_t state)
+{
+    // b[i] = 2 * a[i] + 3 * a[i + 1] + a[i + 2] + a[i + 3]
+    uint32x4_t v = vreinterpretq_u32_u8(state);
+    uint8x16_t r8 = vreinterpretq_u8_u32(
+        vorrq_u32(vshrq_n_u32(v, 8), vshlq_n_u32(v, 24)));
+    uint8x16_t r16 = vreinterpretq_u8_u32(
+        vorrq_u32(vshrq_n_u32(v, 16), vshlq_n_u32(v, 16)));
+    uint8x16_t r24 = vreinterpretq_u8_u32(
+        vorrq_u32(vshrq_n_u32(v, 24), vshlq_n_u32(v, 8)));
+    uint8x16_t t = xtime(veorq_u8(state, r8));
+    return veorq_u8(veorq_u8(t, r8), veorq_u8(r16, r24));
+}
+
+static uint8x16_t
+cipher(uint8x16_t state, const struct Aes128Cbc_RoundKey *roundKey)
+{
+    const struct Aes128Cbc_Key *key = &roundKey->round[0];
+    uint8x16_t newState = addRoundKey(state, key);
+    for (uint32_t round = 1; round < 10; ++round) {
+        ++key;
+        newState = subBytesShiftRows(newState);
+        newState = mixColumns(newState);
+        newState = addRoundKey(newState, key);
+    }
+    ++key;
+    newState = subBytesShiftRows(newState);
+    return addRoundKey(newState, key);
+}
+
+static void
+ctrInit(struct Aes128Ctr *ctx, const struct Aes128Cbc_Key *key,
+    const struct Aes128Cbc_Iv *counter)
+{
+    keyExpansion(key, &ctx->roundKey);
+    ctx->counter = *counter;
 }
+
+static uint8x16_t
+toCounterBlock(const struct Ctr_Counter *c)
+{
+    uint64x2_t v = vcombine_u64(vcreate_u64(c->high), vcreate_u64(c->low));
+    return vrev64q_u8(vreinterpretq_u8_u64(v));
+}
+
+static void
+ctrDecrypt(struct Aes128Ctr *ctx, const void *data,
+    size_t length, void *output)
+{
+    const uint8_t *in = (const uint8_t *)data;
+    uint8_t *out = (uint8_t *)output;
+    struct Ctr_Counter counter = Ctr_load(ctx->counter.data);
+    while (length > 0) {
+        uint8x16_t keyStream[8];
+        size_t n = length / 16;
+        if (n > 8) {
+            n = 8;
+        }
+        for (size_t k = 0; k < n; ++k) {
+            keyStream[k] = cipher(toCounterBlock(&counter), &ctx->roundKey);
+            Ctr_increment(&counter);
+        }
+        for (size_t k = 0; k < n; ++k) {
+            vst1q_u8(out, veorq_u8(vld1q_u8(in), keyStream[k]));
+            in += 16;
+            out += 16;
+        }
+        length -= n * 16;
+    }
+    Ctr_store(&counter, ctx->counter.data);
+}
+
+static void
+cbcEncInit(struct Aes128CbcEnc *ctx, const struct Aes128Cbc_Key *key,
+    const struct Aes128Cbc_Iv *iv)
+{
+    keyExpansion(key, &ctx->roundKey);
+    ctx->iv = *iv;
+}
+
+static void
+cbcEncrypt(struct Aes128CbcEnc *const *ctx,
+    const uint8_t *const *data, uint8_t *const *output,
+    size_t count, size_t length)
+{
+    for (size_t j = 0; j < count; ++j) {
+        uint8x16_t state = vld1q_u8(ctx[j]->iv.data);
+        for (size_t offset = 0; offset < length; offset += 16) {
+            state = veorq_u8(state, vld1q_u8(data[j] + offset));
+            state = cipher(state, &ctx[j]->roundKey);
+            vst1q_u8(output[j] + offset, state);
+        }
+        vst1q_u8(ctx[j]->iv.data, state);
+    }
+}
+
+static int
+alwaysSupported(void)
+{
+    return 1;
+}
+
+const struct Aes128Cbc_Backend Aes128Cbc_neonBackend = {
+    .name = "neon",
+    .capabilities = Aes128Cbc_SIMD,
+    .isSupported = alwaysSupported,
+    .init = cbcInit,
+    .decrypt = cbcDecrypt,
+    .initMany = cbcInitMany,
+    .ecbDecrypt = ecbDecrypt,
+    .ctrInit = ctrInit,
+    .ctrDecrypt = ctrDecrypt,
+    .wideInit = wideInit,
+    .wideDecrypt = wideDecrypt,
+    .encInit = cbcEncInit,
+    .encrypt = cbcEncrypt};
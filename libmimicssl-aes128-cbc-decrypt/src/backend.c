@@ -0,0 +1,309 @@
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "Aes128Cbc.h"
+#include "probes.h"
+
+#if !defined(AES128CBC_BACKEND_ARMV8) \
+    && !defined(AES128CBC_BACKEND_AESNI) \
+    && !defined(AES128CBC_BACKEND_NEON) \
+    && !defined(AES128CBC_BACKEND_GENERIC)
+#error "no backend is specified"
+#endif
+
+#define BACKEND_ENV "MIMICSSL_AES_BACKEND"
+
+/*
+    The backends compiled in, in order of preference.
+*/
+static const struct Aes128Cbc_Backend *const BACKENDS[] = {
+#if defined(AES128CBC_BACKEND_ARMV8)
+    &Aes128Cbc_armv8Backend,
+#endif
+#if defined(AES128CBC_BACKEND_AESNI)
+    &Aes128Cbc_aesniBackend,
+#endif
+#if defined(AES128CBC_BACKEND_NEON)
+    &Aes128Cbc_neonBackend,
+#endif
+#if defined(AES128CBC_BACKEND_GENERIC)
+    &Aes128Cbc_genericBackend,
+#endif
+};
+
+#define BACKEND_COUNT (sizeof(BACKENDS) / sizeof(BACKENDS[0]))
+
+static const struct Aes128Cbc_Backend *selected;
+
+static const struct Aes128Cbc_Backend *
+findBackend(const char *name)
+{
+    for (size_t k = 0; k < BACKEND_COUNT; ++k) {
+        const struct Aes128Cbc_Backend *b = BACKENDS[k];
+        if (strcmp(b->name, name) == 0) {
+            return b->isSupported() ? b : NULL;
+        }
+    }
+    return NULL;
+}
+
+static const struct Aes128Cbc_Backend *
+chooseBackend(void)
+{
+    const struct Aes128Cbc_Backend *b = NULL;
+#if defined(_WIN32)
+    char *name = NULL;
+    size_t size;
+    if (_dupenv_s(&name, &size, BACKEND_ENV) == 0 && name != NULL) {
+        b = findBackend(name);
+    }
+    free(name);
+#else
+    const char *name = getenv(BACKEND_ENV);
+    if (name != NULL) {
+        b = findBackend(name);
+    }
+#endif
+    if (b != NULL) {
+        return b;
+    }
+    for (size_t k = 0; k < BACKEND_COUNT; ++k) {
+        b = BACKENDS[k];
+        if (b->isSupported()) {
+            return b;
+        }
+    }
+    return BACKENDS[BACKEND_COUNT - 1];
+}
+
+static void
+resolveBackend(void)
+{
+    selected = chooseBackend();
+    PROBE2(backend, selected->name, 0);
+}
+
+#if defined(_WIN32)
+
+static INIT_ONCE once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK
+resolveBackendOnce(PINIT_ONCE initOnce, PVOID parameter, PVOID *context)
+{
+    (void)initOnce;
+    (void)parameter;
+    (void)context;
+    resolveBackend();
+    return TRUE;
+}
+
+static void
+ensureResolved(void)
+{
+    InitOnceExecuteOnce(&once, resolveBackendOnce, NULL, NULL);
+}
+
+#else
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void
+ensureResolved(void)
+{
+    pthread_once(&once, resolveBackend);
+}
+
+#endif
+
+const struct Aes128Cbc_Backend *
+Aes128Cbc_getBackend(void)
+{
+    ensureResolved();
+    return selected;
+}
+
+const struct Aes128Cbc_Backend *
+Aes128Cbc_getBackendAt(size_t index)
+{
+    return (index < BACKEND_COUNT) ? BACKENDS[index] : NULL;
+}
+
+int
+Aes128Cbc_selectBackend(const char *name)
+{
+    ensureResolved();
+    if (name == NULL) {
+        selected = chooseBackend();
+        PROBE2(backend, selected->name, 0);
+        return 1;
+    }
+    const struct Aes128Cbc_Backend *b = findBackend(name);
+    if (b == NULL) {
+        return 0;
+    }
+    selected = b;
+    PROBE2(backend, selected->name, 1);
+    return 1;
+}
+
+void
+Aes128Cbc_init(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
+    const struct Aes128Cbc_Iv *iv)
+{
+    const struct Aes128Cbc_Backend *b = Aes128Cbc_getBackend();
+    b->init(ctx, key, iv);
+    ctx->backend = b;
+}
+
+/*
+    Initializes the contexts with the keys and IVs of the same index,
+    AES128CBC_LANES at a time.
+*/
+void
+Aes128Cbc_initMany(struct Aes128Cbc *const *ctx,
+    const struct Aes128Cbc_Key *key, const struct Aes128Cbc_Iv *iv,
+    size_t count)
+{
+    const struct Aes128Cbc_Backend *b = Aes128Cbc_getBackend();
+    for (size_t k = 0; k < count; k += AES128CBC_LANES) {
+        size_t n = count - k;
+        if (n > AES128CBC_LANES) {
+            n = AES128CBC_LANES;
+        }
+        b->initMany(ctx + k, key + k, iv + k, n);
+    }
+    for (size_t k = 0; k < count; ++k) {
+        ctx[k]->backend = b;
+    }
+}
+
+/*
+    The round keys are those of the equivalent inverse cipher, which every
+    backend shares, so they need no further setup.
+*/
+void
+Aes128Cbc_initRoundKey(struct Aes128Cbc *ctx,
+    const struct Aes128Cbc_RoundKey *roundKey,
+    const struct Aes128Cbc_Iv *iv)
+{
+    ctx->roundKey = *roundKey;
+    ctx->iv = *iv;
+    ctx->backend = Aes128Cbc_getBackend();
+}
+
+void
+Aes128Cbc_decrypt(struct Aes128Cbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    ctx->backend->decrypt(ctx, data, length, output);
+}
+
+void
+Aes128Ecb_decrypt(struct Aes128Cbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    ctx->backend->ecbDecrypt(ctx, data, length, output);
+}
+
+void
+Aes128Ctr_init(struct Aes128Ctr *ctx, const struct Aes128Cbc_Key *key,
+    const struct Aes128Cbc_Iv *counter)
+{
+    const struct Aes128Cbc_Backend *b = Aes128Cbc_getBackend();
+    b->ctrInit(ctx, key, counter);
+    ctx->backend = b;
+}
+
+void
+Aes128Ctr_decrypt(struct Aes128Ctr *ctx, const void *data,
+    size_t length, void *output)
+{
+    ctx->backend->ctrDecrypt(ctx, data, length, output);
+}
+
+void
+AesCbc_init(struct AesCbc *ctx, const uint8_t *key, size_t keyLength,
+    const struct Aes128Cbc_Iv *iv)
+{
+    const struct Aes128Cbc_Backend *b = Aes128Cbc_getBackend();
+    b->wideInit(ctx, key, keyLength, iv);
+    ctx->backend = b;
+}
+
+void
+AesCbc_decrypt(struct AesCbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    ctx->backend->wideDecrypt(ctx, data, length, output);
+}
+
+void
+Aes128CbcEnc_init(struct Aes128CbcEnc *ctx,
+    const struct Aes128Cbc_Key *key, const struct Aes128Cbc_Iv *iv)
+{
+    const struct Aes128Cbc_Backend *b = Aes128Cbc_getBackend();
+    b->encInit(ctx, key, iv);
+    ctx->backend = b;
+}
+
+/*
+    Encrypts the streams, AES128CBC_LANES at a time. When a stream ends,
+    the next one takes over its lane, so the lanes stay full as long as
+    there are streams left. The backend of the first lane encrypts all of
+    them, which is fine since the contexts are interchangeable between
+    backends.
+*/
+void
+Aes128CbcEnc_encrypt(struct Aes128CbcEnc *const *ctx,
+    const uint8_t *const *data, uint8_t *const *output,
+    const size_t *length, size_t count)
+{
+    struct Aes128CbcEnc *lane[AES128CBC_LANES];
+    const uint8_t *in[AES128CBC_LANES];
+    uint8_t *out[AES128CBC_LANES];
+    size_t left[AES128CBC_LANES];
+    size_t n = 0;
+    size_t next = 0;
+
+    for (;;) {
+        for (; n < AES128CBC_LANES && next < count; ++next) {
+            if (length[next] == 0) {
+                continue;
+            }
+            lane[n] = ctx[next];
+            in[n] = data[next];
+            out[n] = output[next];
+            left[n] = length[next];
+            ++n;
+        }
+        if (n == 0) {
+            return;
+        }
+        size_t step = left[0];
+        for (size_t j = 1; j < n; ++j) {
+            if (left[j] < step) {
+                step = left[j];
+            }
+        }
+        lane[0]->backend->encrypt(lane, in, out, n, step);
+        size_t m = 0;
+        for (size_t j = 0; j < n; ++j) {
+            if (left[j] == step) {
+                continue;
+            }
+            lane[m] = lane[j];
+            in[m] = in[j] + step;
+            out[m] = out[j] + step;
+            left[m] = left[j] - step;
+            ++m;
+        }
+        n = m;
+    }
+}
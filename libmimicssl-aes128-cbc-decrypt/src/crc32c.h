@@ -0,0 +1,28 @@
+#ifndef crc32c_H
+#define crc32c_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Updates the CRC32C (Castagnoli) checksum with the data. The initial value
+    is 0, as crc32() of zlib.
+*/
+typedef uint32_t (*Crc32c_Function)(uint32_t crc, const void *data,
+    size_t length);
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+/*
+    Returns the fastest implementation that the CPU supports: SSE4.2 on
+    x86_64, the CRC32 extension on ARMv8, or a lookup table otherwise.
+*/
+Crc32c_Function Crc32c_select(void);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
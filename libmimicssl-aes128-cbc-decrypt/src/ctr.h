@@ -0,0 +1,59 @@
+#ifndef ctr_H
+#define ctr_H
+
+#include <stdint.h>
+
+/*
+    The 128-bit big-endian counter block of the CTR mode, split into two
+    native 64-bit integers so that it can be incremented with a carry.
+*/
+struct Ctr_Counter {
+    uint64_t high;
+    uint64_t low;
+};
+
+static inline uint64_t
+Ctr_load64(const uint8_t *b)
+{
+    return ((uint64_t)b[0] << 56)
+        | ((uint64_t)b[1] << 48)
+        | ((uint64_t)b[2] << 40)
+        | ((uint64_t)b[3] << 32)
+        | ((uint64_t)b[4] << 24)
+        | ((uint64_t)b[5] << 16)
+        | ((uint64_t)b[6] << 8)
+        | (uint64_t)b[7];
+}
+
+static inline void
+Ctr_store64(uint64_t v, uint8_t *b)
+{
+    for (int k = 7; k >= 0; --k) {
+        b[k] = (uint8_t)v;
+        v >>= 8;
+    }
+}
+
+static inline struct Ctr_Counter
+Ctr_load(const uint8_t *block)
+{
+    struct Ctr_Counter c = {Ctr_load64(block), Ctr_load64(block + 8)};
+    return c;
+}
+
+static inline void
+Ctr_store(const struct Ctr_Counter *c, uint8_t *block)
+{
+    Ctr_store64(c->high, block);
+    Ctr_store64(c->low, block + 8);
+}
+
+static inline void
+Ctr_increment(struct Ctr_Counter *c)
+{
+    if (++c->low == 0) {
+        ++c->high;
+    }
+}
+
+#endif
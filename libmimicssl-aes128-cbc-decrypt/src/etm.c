@@ -0,0 +1,134 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "evp.h"
+#include "sha256.h"
+
+/*
+    The size of the chunks that are MACed and then decrypted, small enough
+    that the ciphertext is still in the L1 cache when it is decrypted.
+*/
+#define ETM_CHUNK_SIZE 4096
+
+struct EVP_ETM_CTX {
+    EVP_CIPHER_CTX *cipher;
+    struct HmacSha256 mac;
+};
+
+EVP_ETM_CTX *
+EVP_ETM_CTX_new(void)
+{
+    EVP_ETM_CTX *c = (EVP_ETM_CTX *)malloc(sizeof(*c));
+    if (c == NULL) {
+        return NULL;
+    }
+    c->cipher = EVP_CIPHER_CTX_new();
+    if (c->cipher == NULL) {
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void
+EVP_ETM_CTX_free(EVP_ETM_CTX *c)
+{
+    EVP_CIPHER_CTX_free(c->cipher);
+    memset(&c->mac, 0, sizeof(c->mac));
+    free(c);
+}
+
+int
+EVP_ETM_DecryptInit(EVP_ETM_CTX *ctx, const unsigned char *key,
+    const unsigned char *macKey, int macKeyLength, const unsigned char *iv)
+{
+    if (macKeyLength < 0) {
+        return 0;
+    }
+    if (!EVP_DecryptInit_ex(ctx->cipher, EVP_aes_128_cbc(), NULL, key, iv)) {
+        return 0;
+    }
+    HmacSha256_init(&ctx->mac, macKey, (size_t)macKeyLength);
+    HmacSha256_update(&ctx->mac, iv, 16);
+    return 1;
+}
+
+int
+EVP_ETM_DecryptUpdate(EVP_ETM_CTX *ctx, unsigned char *out, int *outl,
+    const unsigned char *in, int inl)
+{
+    if (inl < 0 || (inl % 16) != 0) {
+        return 0;
+    }
+    int total = 0;
+    while (inl > 0) {
+        int size = (inl < ETM_CHUNK_SIZE) ? inl : ETM_CHUNK_SIZE;
+        int n;
+        HmacSha256_update(&ctx->mac, in, (size_t)size);
+        if (!EVP_DecryptUpdate(ctx->cipher, out + total, &n, in, size)) {
+            return 0;
+        }
+        total += n;
+        in += size;
+        inl -= size;
+    }
+    *outl = total;
+    return 1;
+}
+
+/*
+    Compares the tags without any branch that depends on their content.
+*/
+static int
+tagEquals(const uint8_t *expected, const uint8_t *actual, size_t length)
+{
+    uint32_t diff = 0;
+    for (size_t k = 0; k < length; ++k) {
+        diff |= expected[k] ^ actual[k];
+    }
+    return (int)(((diff | (0u - diff)) >> 31) ^ 1);
+}
+
+int
+EVP_ETM_DecryptFinal(EVP_ETM_CTX *ctx, unsigned char *outm, int *outl,
+    const unsigned char *tag, int tagLength)
+{
+    if (tagLength < 16 || tagLength > 32) {
+        return 0;
+    }
+    uint8_t expected[32];
+    HmacSha256_final(&ctx->mac, expected);
+    int match = tagEquals(expected, tag, (size_t)tagLength);
+    memset(expected, 0, sizeof(expected));
+    if (!match) {
+        return 0;
+    }
+    return EVP_DecryptFinal_ex(ctx->cipher, outm, outl);
+}
+
+int
+EVP_ETM_decrypt(const unsigned char *key, const unsigned char *macKey,
+    int macKeyLength, const unsigned char *iv,
+    const unsigned char *in, int inl,
+    const unsigned char *tag, int tagLength,
+    unsigned char *out, int *outl)
+{
+    EVP_ETM_CTX *ctx = EVP_ETM_CTX_new();
+    if (ctx == NULL) {
+        return 0;
+    }
+    int total = 0;
+    int n;
+    int result = EVP_ETM_DecryptInit(ctx, key, macKey, macKeyLength, iv)
+        && EVP_ETM_DecryptUpdate(ctx, out, &total, in, inl)
+        && EVP_ETM_DecryptFinal(ctx, out + total, &n, tag, tagLength);
+    EVP_ETM_CTX_free(ctx);
+    if (!result) {
+        if (inl > 0) {
+            memset(out, 0, (size_t)inl);
+        }
+        return 0;
+    }
+    *outl = total + n;
+    return 1;
+}
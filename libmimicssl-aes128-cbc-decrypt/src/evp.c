@@ -2,17 +2,29 @@
 #define __STDC_WANT_LIB_EXT1__ 1
 #endif
 
+#include <limits.h>
 #include <stdlib.h>
 #include "libext1.h"
 
 #include "evp.h"
 #include "Aes128Cbc.h"
+#include "crc32c.h"
+#include "probes.h"
+#include "stats.h"
 
 struct EVP_CIPHER_CTX {
     const EVP_CIPHER *cipher;
     void *data;
     uint8_t padding[16];
     uint32_t hasPadding;
+    uint32_t paddingEnabled;
+    uint32_t encrypting;
+    uint32_t bufferLength;
+    Crc32c_Function crc32c;
+    uint32_t crc;
+#if STATS_ENABLED
+    struct Stats stats;
+#endif
 };
 
 struct EVP_CIPHER {
@@ -21,12 +33,45 @@ struct EVP_CIPHER {
     int (*update)(struct EVP_CIPHER_CTX *, void *,
         unsigned char *out, int *outl, const unsigned char *in, int inl);
     int (*finalize)(struct EVP_CIPHER_CTX *, unsigned char *outm, int *outl);
+    void (*decrypt)(void *, const void *in, size_t length, void *out);
+    size_t keyLength;
+    void *(*encNewContext)(struct EVP_CIPHER_CTX *,
+        const unsigned char *key, const unsigned char *iv);
 };
 
 struct ENGINE {
     char pad;
 };
 
+#if STATS_ENABLED
+static struct AtomicStats globalStats;
+#endif
+
+/*
+    The kernel contexts hold round keys that must be aligned to
+    AES128CBC_ALIGNMENT, which malloc() does not guarantee.
+*/
+static void *
+allocContext(size_t size)
+{
+#if defined(_WIN32)
+    return _aligned_malloc(size, AES128CBC_ALIGNMENT);
+#else
+    void *p;
+    return (posix_memalign(&p, AES128CBC_ALIGNMENT, size) == 0) ? p : NULL;
+#endif
+}
+
+static void
+freeContext(void *p)
+{
+#if defined(_WIN32)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
 EVP_CIPHER_CTX *
 EVP_CIPHER_CTX_new(void)
 {
@@ -37,6 +82,15 @@ EVP_CIPHER_CTX_new(void)
     c->cipher = NULL;
     c->data = NULL;
     c->hasPadding = 0;
+    c->paddingEnabled = 1;
+    c->encrypting = 0;
+    c->bufferLength = 0;
+    c->crc32c = NULL;
+    c->crc = 0;
+#if STATS_ENABLED
+    c->stats = (struct Stats){0};
+#endif
+    STATS_ADD(&c->stats, &globalStats, allocations, 1);
     return c;
 }
 
@@ -44,16 +98,28 @@ int
 EVP_CIPHER_CTX_reset(EVP_CIPHER_CTX *c)
 {
     c->cipher = NULL;
-    free(c->data);
+    freeContext(c->data);
     c->data = NULL;
     c->hasPadding = 0;
+    c->paddingEnabled = 1;
+    c->encrypting = 0;
+    c->bufferLength = 0;
+    c->crc32c = NULL;
+    c->crc = 0;
+    return 1;
+}
+
+int
+EVP_CIPHER_CTX_set_padding(EVP_CIPHER_CTX *c, int pad)
+{
+    c->paddingEnabled = (pad != 0);
     return 1;
 }
 
 void
 EVP_CIPHER_CTX_free(EVP_CIPHER_CTX *c)
 {
-    free(c->data);
+    freeContext(c->data);
     free(c);
 }
 
@@ -61,45 +127,166 @@ static void *
 aesNewContext(struct EVP_CIPHER_CTX *c,
     const unsigned char *key, const unsigned char *iv)
 {
-    struct Aes128Cbc *ctx = (struct Aes128Cbc *)malloc(sizeof(*ctx));
+    struct Aes128Cbc *ctx = (struct Aes128Cbc *)allocContext(sizeof(*ctx));
     if (ctx == NULL) {
         return NULL;
     }
+    STATS_ADD(&c->stats, &globalStats, allocations, 1);
     struct Aes128Cbc_Key key0;
     struct Aes128Cbc_Iv iv0;
     MEMCPY(key0.data, key, 16);
     MEMCPY(iv0.data, iv, 16);
     Aes128Cbc_init(ctx, &key0, &iv0);
+    STATS_ADD(&c->stats, &globalStats, keyExpansions, 1);
     c->hasPadding = 0;
     return ctx;
 }
 
+static void
+aesDecrypt(void *data, const void *in, size_t length, void *out)
+{
+    Aes128Cbc_decrypt((struct Aes128Cbc *)data, in, length, out);
+}
+
+static void *
+ecbNewContext(struct EVP_CIPHER_CTX *c,
+    const unsigned char *key, const unsigned char *iv)
+{
+    (void)iv;
+    struct Aes128Cbc *ctx = (struct Aes128Cbc *)allocContext(sizeof(*ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    STATS_ADD(&c->stats, &globalStats, allocations, 1);
+    struct Aes128Cbc_Key key0;
+    struct Aes128Cbc_Iv iv0 = {0};
+    MEMCPY(key0.data, key, 16);
+    Aes128Cbc_init(ctx, &key0, &iv0);
+    STATS_ADD(&c->stats, &globalStats, keyExpansions, 1);
+    c->hasPadding = 0;
+    return ctx;
+}
+
+static void
+ecbDecrypt(void *data, const void *in, size_t length, void *out)
+{
+    Aes128Ecb_decrypt((struct Aes128Cbc *)data, in, length, out);
+}
+
+static void *
+wideNewContext(struct EVP_CIPHER_CTX *c,
+    const unsigned char *key, const unsigned char *iv)
+{
+    struct AesCbc *ctx = (struct AesCbc *)allocContext(sizeof(*ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    STATS_ADD(&c->stats, &globalStats, allocations, 1);
+    struct Aes128Cbc_Iv iv0;
+    MEMCPY(iv0.data, iv, 16);
+    AesCbc_init(ctx, key, c->cipher->keyLength, &iv0);
+    STATS_ADD(&c->stats, &globalStats, keyExpansions, 1);
+    c->hasPadding = 0;
+    return ctx;
+}
+
+static void
+wideDecrypt(void *data, const void *in, size_t length, void *out)
+{
+    AesCbc_decrypt((struct AesCbc *)data, in, length, out);
+}
+
+/*
+    Returns the length of the PKCS#7 padding of the block, or 0 if the
+    padding is invalid. There are no branches or table lookups that depend
+    on the content of the block, so the timing does not reveal where the
+    padding check failed.
+*/
+static uint32_t
+paddingLength(const uint8_t *block)
+{
+    uint32_t n = block[15];
+    // Zero unless 1 <= n <= 16
+    uint32_t bad = (n - 1) & ~(uint32_t)15;
+    for (uint32_t k = 0; k < 16; ++k) {
+        // All ones if the k-th byte is part of the padding, zero otherwise
+        uint32_t mask = 0u - (((15 - k) - n) >> 31);
+        bad |= (block[k] ^ n) & mask;
+    }
+    // One if bad is zero, zero otherwise
+    uint32_t valid = ((bad | (0u - bad)) >> 31) ^ 1;
+    return n & (0u - valid);
+}
+
+/*
+    The size of the slices to decrypt before computing their checksum, small
+    enough that the plaintext is still in the L1 cache.
+*/
+#define CRC_SLICE_SIZE 4096
+
+static void
+decryptBlocks(struct EVP_CIPHER_CTX *c,
+    void (*decrypt)(void *, const void *, size_t, void *),
+    void *data, const uint8_t *in, size_t length, uint8_t *out)
+{
+    if (c->crc32c == NULL) {
+        decrypt(data, in, length, out);
+        return;
+    }
+    while (length > 0) {
+        size_t size = (length < CRC_SLICE_SIZE) ? length : CRC_SLICE_SIZE;
+        decrypt(data, in, size, out);
+        c->crc = c->crc32c(c->crc, out, size);
+        in += size;
+        out += size;
+        length -= size;
+    }
+}
+
+/*
+    Common to AES-128, AES-192, and AES-256 in the CBC mode, and AES-128 in
+    the ECB mode. Unless the padding is disabled, the last block is held
+    back until aesFinalize() since it may contain the padding.
+*/
 static int
 aesUpdate(struct EVP_CIPHER_CTX *c,
     void *data, unsigned char *out, int *outl,
     const unsigned char *in, int inl)
 {
-    struct Aes128Cbc *ctx = (struct Aes128Cbc *)data;
+    void (*decrypt)(void *, const void *, size_t, void *) = c->cipher->decrypt;
     if (inl < 0 || (inl % 16) != 0) {
         return 0;
     }
     if (inl == 0) {
+        *outl = 0;
         return 1;
     }
     int outSize = 0;
     if (c->hasPadding) {
         MEMCPY(out, c->padding, 16);
+        if (c->crc32c != NULL) {
+            c->crc = c->crc32c(c->crc, out, 16);
+        }
         out += 16;
         outSize += 16;
     }
-    int mainSize = inl - 16;
-    if (mainSize > 0) {
-        Aes128Cbc_decrypt(ctx, in, mainSize, out);
-        outSize += mainSize;
-        in += mainSize;
+    STATS_CLOCK(kernelStart);
+    if (!c->paddingEnabled) {
+        decryptBlocks(c, decrypt, data, in, (size_t)inl, out);
+        outSize += inl;
+        c->hasPadding = 0;
+    } else {
+        int mainSize = inl - 16;
+        if (mainSize > 0) {
+            decryptBlocks(c, decrypt, data, in, (size_t)mainSize, out);
+            outSize += mainSize;
+            in += mainSize;
+        }
+        decrypt(data, in, 16, c->padding);
+        c->hasPadding = 1;
     }
-    Aes128Cbc_decrypt(ctx, in, 16, c->padding);
-    c->hasPadding = 1;
+    STATS_ADD(&c->stats, &globalStats, kernelNanoseconds,
+        Stats_now() - kernelStart);
     *outl = outSize;
     return 1;
 }
@@ -108,31 +295,84 @@ static int
 aesFinalize(struct EVP_CIPHER_CTX *c,
     unsigned char *outm, int *outl)
 {
+    if (!c->paddingEnabled) {
+        *outl = 0;
+        if (c->hasPadding) {
+            MEMCPY(outm, c->padding, 16);
+            if (c->crc32c != NULL) {
+                c->crc = c->crc32c(c->crc, outm, 16);
+            }
+            *outl = 16;
+            c->hasPadding = 0;
+        }
+        return 1;
+    }
     if (!c->hasPadding) {
         return 0;
     }
-    const uint8_t *p = c->padding;
-    for (uint32_t start = 0; start < 0x10; ++start) {
-        uint8_t padValue = (uint8_t)(0x10 - start);
-        uint32_t k = start;
-        while (k < 0x10 && p[k] == padValue) {
-            ++k;
-        }
-        if (k == 0x10) {
-            *outl = start;
-            if (start > 0) {
-                MEMCPY(outm, c->padding, start);
-            }
-            return 1;
+    uint32_t n = paddingLength(c->padding);
+    if (n == 0) {
+        return 0;
+    }
+    uint32_t start = 16 - n;
+    *outl = (int)start;
+    if (start > 0) {
+        MEMCPY(outm, c->padding, start);
+        if (c->crc32c != NULL) {
+            c->crc = c->crc32c(c->crc, outm, start);
         }
     }
-    return 0;
+    return 1;
+}
+
+static void *
+encNewContext(struct EVP_CIPHER_CTX *c,
+    const unsigned char *key, const unsigned char *iv)
+{
+    struct Aes128CbcEnc *ctx = (struct Aes128CbcEnc *)allocContext(
+        sizeof(*ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    STATS_ADD(&c->stats, &globalStats, allocations, 1);
+    struct Aes128Cbc_Key key0;
+    struct Aes128Cbc_Iv iv0;
+    MEMCPY(key0.data, key, 16);
+    MEMCPY(iv0.data, iv, 16);
+    Aes128CbcEnc_init(ctx, &key0, &iv0);
+    STATS_ADD(&c->stats, &globalStats, keyExpansions, 1);
+    c->bufferLength = 0;
+    return ctx;
 }
 
 static const EVP_CIPHER aes128cbc = {
     .newContext = aesNewContext,
     .update = aesUpdate,
-    .finalize = aesFinalize};
+    .finalize = aesFinalize,
+    .decrypt = aesDecrypt,
+    .keyLength = 16,
+    .encNewContext = encNewContext};
+
+static const EVP_CIPHER aes128ecb = {
+    .newContext = ecbNewContext,
+    .update = aesUpdate,
+    .finalize = aesFinalize,
+    .decrypt = ecbDecrypt,
+    .keyLength = 16};
+
+static const EVP_CIPHER aes192cbc = {
+    .newContext = wideNewContext,
+    .update = aesUpdate,
+    .finalize = aesFinalize,
+    .decrypt = wideDecrypt,
+    .keyLength = 24};
+
+static const EVP_CIPHER aes256cbc = {
+    .newContext = wideNewContext,
+    .update = aesUpdate,
+    .finalize = aesFinalize,
+    .decrypt = wideDecrypt,
+    .keyLength = 32};
 
 const EVP_CIPHER *
 EVP_aes_128_cbc(void)
@@ -140,6 +380,165 @@ EVP_aes_128_cbc(void)
     return &aes128cbc;
 }
 
+const EVP_CIPHER *
+EVP_aes_128_ecb(void)
+{
+    return &aes128ecb;
+}
+
+const EVP_CIPHER *
+EVP_aes_192_cbc(void)
+{
+    return &aes192cbc;
+}
+
+const EVP_CIPHER *
+EVP_aes_256_cbc(void)
+{
+    return &aes256cbc;
+}
+
+struct CtrContext {
+    struct Aes128Ctr ctr;
+    uint8_t keyStream[16];
+    uint32_t keyStreamOffset;
+};
+
+static void *
+ctrNewContext(struct EVP_CIPHER_CTX *c,
+    const unsigned char *key, const unsigned char *iv)
+{
+    struct CtrContext *ctx = (struct CtrContext *)allocContext(sizeof(*ctx));
+    if (ctx == NULL) {
+        return NULL;
+    }
+    STATS_ADD(&c->stats, &globalStats, allocations, 1);
+    struct Aes128Cbc_Key key0;
+    struct Aes128Cbc_Iv iv0;
+    MEMCPY(key0.data, key, 16);
+    MEMCPY(iv0.data, iv, 16);
+    Aes128Ctr_init(&ctx->ctr, &key0, &iv0);
+    STATS_ADD(&c->stats, &globalStats, keyExpansions, 1);
+    ctx->keyStreamOffset = 16;
+    c->hasPadding = 0;
+    return ctx;
+}
+
+static int
+ctrUpdate(struct EVP_CIPHER_CTX *c,
+    void *data, unsigned char *out, int *outl,
+    const unsigned char *in, int inl)
+{
+    struct CtrContext *ctx = (struct CtrContext *)data;
+#if !STATS_ENABLED
+    (void)c;
+#endif
+    if (inl < 0) {
+        return 0;
+    }
+    *outl = inl;
+    while (inl > 0 && ctx->keyStreamOffset < 16) {
+        *out = *in ^ ctx->keyStream[ctx->keyStreamOffset];
+        ++ctx->keyStreamOffset;
+        ++out;
+        ++in;
+        --inl;
+    }
+    STATS_CLOCK(kernelStart);
+    int mainSize = inl & ~15;
+    if (mainSize > 0) {
+        Aes128Ctr_decrypt(&ctx->ctr, in, mainSize, out);
+        out += mainSize;
+        in += mainSize;
+        inl -= mainSize;
+    }
+    if (inl > 0) {
+        uint8_t *k = ctx->keyStream;
+        memset(k, 0, 16);
+        Aes128Ctr_decrypt(&ctx->ctr, k, 16, k);
+        for (int j = 0; j < inl; ++j) {
+            out[j] = in[j] ^ k[j];
+        }
+        ctx->keyStreamOffset = (uint32_t)inl;
+    }
+    STATS_ADD(&c->stats, &globalStats, kernelNanoseconds,
+        Stats_now() - kernelStart);
+    return 1;
+}
+
+static int
+ctrFinalize(struct EVP_CIPHER_CTX *c,
+    unsigned char *outm, int *outl)
+{
+    (void)c;
+    (void)outm;
+    *outl = 0;
+    return 1;
+}
+
+static const EVP_CIPHER aes128ctr = {
+    .newContext = ctrNewContext,
+    .update = ctrUpdate,
+    .finalize = ctrFinalize,
+    .keyLength = 16};
+
+const EVP_CIPHER *
+EVP_aes_128_ctr(void)
+{
+    return &aes128ctr;
+}
+
+int
+EVP_CIPHER_key_length(const EVP_CIPHER *cipher)
+{
+    return (int)cipher->keyLength;
+}
+
+_Static_assert(EVP_AES_BACKEND_HARDWARE == Aes128Cbc_HARDWARE,
+    "EVP_AES_BACKEND_HARDWARE");
+_Static_assert(EVP_AES_BACKEND_SIMD == Aes128Cbc_SIMD,
+    "EVP_AES_BACKEND_SIMD");
+_Static_assert(EVP_AES_BACKEND_CONSTANT_TIME == Aes128Cbc_CONSTANT_TIME,
+    "EVP_AES_BACKEND_CONSTANT_TIME");
+
+const char *
+EVP_aes_backend_name(void)
+{
+    return Aes128Cbc_getBackend()->name;
+}
+
+unsigned int
+EVP_aes_backend_capabilities(void)
+{
+    return Aes128Cbc_getBackend()->capabilities;
+}
+
+const char *
+EVP_aes_backend_get(int index, unsigned int *capabilities, int *supported)
+{
+    if (index < 0) {
+        return NULL;
+    }
+    const struct Aes128Cbc_Backend *b = Aes128Cbc_getBackendAt(
+        (size_t)index);
+    if (b == NULL) {
+        return NULL;
+    }
+    if (capabilities != NULL) {
+        *capabilities = b->capabilities;
+    }
+    if (supported != NULL) {
+        *supported = b->isSupported();
+    }
+    return b->name;
+}
+
+int
+EVP_aes_backend_select(const char *name)
+{
+    return Aes128Cbc_selectBackend(name);
+}
+
 int
 EVP_DecryptInit_ex(EVP_CIPHER_CTX *ctx, const EVP_CIPHER *cipher,
     ENGINE *impl, const unsigned char *key, const unsigned char *iv)
@@ -150,20 +549,697 @@ EVP_DecryptInit_ex(EVP_CIPHER_CTX *ctx, const EVP_CIPHER *cipher,
     ctx->cipher = cipher;
     void *data = cipher->newContext(ctx, key, iv);
     if (data == NULL) {
+        PROBE2(decrypt_init, ctx, 0);
         return 0;
     }
     ctx->data = data;
+    PROBE2(decrypt_init, ctx, 1);
     return 1;
 }
+
+/*
+    Resets the first count contexts that EVP_DecryptInit_multi() has
+    initialized before it fails, so that none of them is left initialized.
+*/
+static int
+resetMany(EVP_CIPHER_CTX *const *ctx, int count)
+{
+    for (int k = 0; k < count; ++k) {
+        EVP_CIPHER_CTX_reset(ctx[k]);
+    }
+    return 0;
+}
+
+/*
+    The AES-128 CBC and ECB contexts are initialized in batches, so that the
+    backend can expand the keys in parallel.
+*/
+int
+EVP_DecryptInit_multi(EVP_CIPHER_CTX *const *ctx, const EVP_CIPHER *cipher,
+    const unsigned char *const *key, const unsigned char *const *iv,
+    int count)
+{
+    if (count < 0) {
+        return 0;
+    }
+    for (int k = 0; k < count; ++k) {
+        if (ctx[k]->cipher != NULL) {
+            return 0;
+        }
+    }
+    if (cipher != &aes128cbc && cipher != &aes128ecb) {
+        for (int k = 0; k < count; ++k) {
+            if (!EVP_DecryptInit_ex(ctx[k], cipher, NULL, key[k],
+                    (iv != NULL) ? iv[k] : NULL)) {
+                return resetMany(ctx, k + 1);
+            }
+        }
+        return 1;
+    }
+    struct Aes128Cbc *data[AES128CBC_LANES];
+    struct Aes128Cbc_Key keys[AES128CBC_LANES];
+    struct Aes128Cbc_Iv ivs[AES128CBC_LANES];
+    for (int base = 0; base < count; base += AES128CBC_LANES) {
+        int n = count - base;
+        if (n > AES128CBC_LANES) {
+            n = AES128CBC_LANES;
+        }
+        for (int j = 0; j < n; ++j) {
+            data[j] = (struct Aes128Cbc *)allocContext(sizeof(*data[j]));
+            if (data[j] == NULL) {
+                for (int i = 0; i < j; ++i) {
+                    freeContext(data[i]);
+                }
+                PROBE2(decrypt_init, ctx[base + j], 0);
+                return resetMany(ctx, base);
+            }
+            STATS_ADD(&ctx[base + j]->stats, &globalStats, allocations, 1);
+            MEMCPY(keys[j].data, key[base + j], 16);
+            if (iv != NULL && iv[base + j] != NULL) {
+                MEMCPY(ivs[j].data, iv[base + j], 16);
+            } else {
+                ivs[j] = (struct Aes128Cbc_Iv){0};
+            }
+        }
+        Aes128Cbc_initMany(data, keys, ivs, (size_t)n);
+        for (int j = 0; j < n; ++j) {
+            EVP_CIPHER_CTX *c = ctx[base + j];
+            STATS_ADD(&c->stats, &globalStats, keyExpansions, 1);
+            c->cipher = cipher;
+            c->data = data[j];
+            c->hasPadding = 0;
+            PROBE2(decrypt_init, c, 1);
+        }
+    }
+    return 1;
+}
+
+int
+EVP_DecryptInit_roundkey(EVP_CIPHER_CTX *ctx, const EVP_CIPHER *cipher,
+    const unsigned char *roundKey, const unsigned char *iv)
+{
+    if (ctx->cipher != NULL
+            || (cipher != &aes128cbc && cipher != &aes128ecb)) {
+        return 0;
+    }
+    struct Aes128Cbc *data = (struct Aes128Cbc *)allocContext(sizeof(*data));
+    if (data == NULL) {
+        PROBE2(decrypt_init, ctx, 0);
+        return 0;
+    }
+    STATS_ADD(&ctx->stats, &globalStats, allocations, 1);
+    struct Aes128Cbc_RoundKey round;
+    struct Aes128Cbc_Iv iv0 = {0};
+    _Static_assert(sizeof(round.round) == EVP_AES_128_ROUND_KEY_LENGTH,
+        "EVP_AES_128_ROUND_KEY_LENGTH");
+    MEMCPY(round.round, roundKey, sizeof(round.round));
+    if (iv != NULL && cipher == &aes128cbc) {
+        MEMCPY(iv0.data, iv, 16);
+    }
+    Aes128Cbc_initRoundKey(data, &round, &iv0);
+    ctx->cipher = cipher;
+    ctx->data = data;
+    ctx->hasPadding = 0;
+    PROBE2(decrypt_init, ctx, 1);
+    return 1;
+}
+
 int
 EVP_DecryptUpdate(EVP_CIPHER_CTX *ctx, unsigned char *out, int *outl,
     const unsigned char *in, int inl)
 {
-    return ctx->cipher->update(ctx, ctx->data, out, outl, in, inl);
+    if (ctx->encrypting) {
+        return 0;
+    }
+    PROBE2(decrypt_update_entry, ctx, inl);
+    STATS_CLOCK(start);
+    int result = ctx->cipher->update(ctx, ctx->data, out, outl, in, inl);
+    PROBE4(decrypt_update_return, ctx, inl, (result ? *outl : 0), result);
+    if (result) {
+        STATS_ADD(&ctx->stats, &globalStats, updateCalls, 1);
+        STATS_ADD(&ctx->stats, &globalStats, bytesDecrypted, (uint64_t)inl);
+        STATS_ADD(&ctx->stats, &globalStats, totalNanoseconds,
+            Stats_now() - start);
+    }
+    return result;
+}
+
+/*
+    A position in a scatter/gather list.
+*/
+struct IovCursor {
+    const EVP_IOVEC *v;
+    size_t count;
+    size_t index;
+    size_t offset;
+};
+
+/*
+    Returns the address of the current position and sets the number of the
+    contiguous bytes that follow it to *size, skipping empty segments.
+*/
+static uint8_t *
+iovPeek(struct IovCursor *cur, size_t *size)
+{
+    while (cur->index < cur->count
+            && cur->offset == cur->v[cur->index].iov_len) {
+        ++cur->index;
+        cur->offset = 0;
+    }
+    if (cur->index == cur->count) {
+        *size = 0;
+        return NULL;
+    }
+    *size = cur->v[cur->index].iov_len - cur->offset;
+    return (uint8_t *)cur->v[cur->index].iov_base + cur->offset;
+}
+
+static void
+iovGather(struct IovCursor *cur, uint8_t *out, size_t length)
+{
+    while (length > 0) {
+        size_t size;
+        const uint8_t *p = iovPeek(cur, &size);
+        if (size > length) {
+            size = length;
+        }
+        MEMCPY(out, p, size);
+        cur->offset += size;
+        out += size;
+        length -= size;
+    }
+}
+
+static void
+iovScatter(struct IovCursor *cur, const uint8_t *in, size_t length)
+{
+    while (length > 0) {
+        size_t size;
+        uint8_t *p = iovPeek(cur, &size);
+        if (size > length) {
+            size = length;
+        }
+        MEMCPY(p, in, size);
+        cur->offset += size;
+        in += size;
+        length -= size;
+    }
+}
+
+static int
+iovTotal(const EVP_IOVEC *v, int count, size_t *total)
+{
+    size_t sum = 0;
+    for (int k = 0; k < count; ++k) {
+        if (v[k].iov_len > (size_t)INT_MAX - sum) {
+            return 0;
+        }
+        sum += v[k].iov_len;
+    }
+    *total = sum;
+    return 1;
+}
+
+/*
+    The runs shorter than this are gathered into a buffer of this size
+    before decryption, so that the kernel decrypts eight blocks at a time
+    even if the segments are small.
+*/
+#define IOV_STAGE_SIZE 128
+
+/*
+    aesUpdate() across the segments. The runs of whole blocks that are
+    contiguous in both the input and the output are decrypted in place.
+*/
+static void
+aesUpdateIov(struct EVP_CIPHER_CTX *c, struct IovCursor *out,
+    struct IovCursor *in, size_t inl)
+{
+    void (*decrypt)(void *, const void *, size_t, void *) = c->cipher->decrypt;
+    void *data = c->data;
+    uint8_t stageIn[IOV_STAGE_SIZE];
+    uint8_t stageOut[IOV_STAGE_SIZE];
+
+    if (c->hasPadding) {
+        iovScatter(out, c->padding, 16);
+        if (c->crc32c != NULL) {
+            c->crc = c->crc32c(c->crc, c->padding, 16);
+        }
+    }
+    STATS_CLOCK(kernelStart);
+    size_t mainSize = c->paddingEnabled ? inl - 16 : inl;
+    while (mainSize > 0) {
+        size_t inSize;
+        size_t outSize;
+        const uint8_t *p = iovPeek(in, &inSize);
+        uint8_t *o = iovPeek(out, &outSize);
+        size_t size = (inSize < outSize) ? inSize : outSize;
+        if (size > mainSize) {
+            size = mainSize;
+        }
+        size &= ~(size_t)15;
+        if (size >= IOV_STAGE_SIZE) {
+            decryptBlocks(c, decrypt, data, p, size, o);
+            in->offset += size;
+            out->offset += size;
+        } else {
+            size = (mainSize < IOV_STAGE_SIZE) ? mainSize : IOV_STAGE_SIZE;
+            iovGather(in, stageIn, size);
+            decryptBlocks(c, decrypt, data, stageIn, size, stageOut);
+            iovScatter(out, stageOut, size);
+        }
+        mainSize -= size;
+    }
+    if (c->paddingEnabled) {
+        iovGather(in, stageIn, 16);
+        decrypt(data, stageIn, 16, c->padding);
+        c->hasPadding = 1;
+    } else {
+        c->hasPadding = 0;
+    }
+    STATS_ADD(&c->stats, &globalStats, kernelNanoseconds,
+        Stats_now() - kernelStart);
+}
+
+/*
+    The stream ciphers have no blocks to hold back, so the runs contiguous
+    in both the input and the output go to update() as they are.
+*/
+static void
+streamUpdateIov(struct EVP_CIPHER_CTX *c, struct IovCursor *out,
+    struct IovCursor *in, size_t inl)
+{
+    while (inl > 0) {
+        size_t inSize;
+        size_t outSize;
+        const uint8_t *p = iovPeek(in, &inSize);
+        uint8_t *o = iovPeek(out, &outSize);
+        size_t size = (inSize < outSize) ? inSize : outSize;
+        if (size > inl) {
+            size = inl;
+        }
+        int outl;
+        c->cipher->update(c, c->data, o, &outl, p, (int)size);
+        in->offset += size;
+        out->offset += size;
+        inl -= size;
+    }
+}
+
+int
+EVP_DecryptUpdate_iov(EVP_CIPHER_CTX *ctx,
+    const EVP_IOVEC *out, int outcnt, int *outl,
+    const EVP_IOVEC *in, int incnt)
+{
+    size_t inl;
+    size_t room;
+    if (ctx->encrypting || ctx->data == NULL || outcnt < 0 || incnt < 0
+            || !iovTotal(in, incnt, &inl) || !iovTotal(out, outcnt, &room)) {
+        return 0;
+    }
+    int isBlockCipher = (ctx->cipher->update == aesUpdate);
+    if (isBlockCipher && (inl % 16) != 0) {
+        return 0;
+    }
+    /*
+        The block held back by a previous update is written as well if the
+        padding has been disabled since.
+    */
+    size_t outSize = (!isBlockCipher || inl == 0)
+        ? inl
+        : (ctx->hasPadding ? 16 : 0)
+            + (ctx->paddingEnabled ? inl - 16 : inl);
+    if (room < outSize) {
+        return 0;
+    }
+    PROBE2(decrypt_update_entry, ctx, (int)inl);
+    STATS_CLOCK(start);
+    struct IovCursor inCursor = {in, (size_t)incnt, 0, 0};
+    struct IovCursor outCursor = {out, (size_t)outcnt, 0, 0};
+    if (inl == 0) {
+        *outl = 0;
+    } else if (isBlockCipher) {
+        aesUpdateIov(ctx, &outCursor, &inCursor, inl);
+        *outl = (int)outSize;
+    } else {
+        streamUpdateIov(ctx, &outCursor, &inCursor, inl);
+        *outl = (int)inl;
+    }
+    PROBE4(decrypt_update_return, ctx, (int)inl, *outl, 1);
+    STATS_ADD(&ctx->stats, &globalStats, updateCalls, 1);
+    STATS_ADD(&ctx->stats, &globalStats, bytesDecrypted, (uint64_t)inl);
+    STATS_ADD(&ctx->stats, &globalStats, totalNanoseconds,
+        Stats_now() - start);
+    return 1;
 }
 
 int
 EVP_DecryptFinal_ex(EVP_CIPHER_CTX *ctx, unsigned char *outm, int *outl)
 {
-    return ctx->cipher->finalize(ctx, outm, outl);
+    if (ctx->encrypting) {
+        return 0;
+    }
+    int result = ctx->cipher->finalize(ctx, outm, outl);
+    PROBE3(decrypt_final, ctx, (result ? *outl : 0), result);
+    return result;
+}
+
+int
+EVP_EncryptInit_ex(EVP_CIPHER_CTX *ctx, const EVP_CIPHER *cipher,
+    ENGINE *impl, const unsigned char *key, const unsigned char *iv)
+{
+    if (ctx->cipher != NULL || impl != NULL
+            || cipher->encNewContext == NULL) {
+        return 0;
+    }
+    ctx->cipher = cipher;
+    ctx->encrypting = 1;
+    void *data = cipher->encNewContext(ctx, key, iv);
+    if (data == NULL) {
+        return 0;
+    }
+    ctx->data = data;
+    return 1;
+}
+
+int
+EVP_EncryptUpdate(EVP_CIPHER_CTX *ctx, unsigned char *out, int *outl,
+    const unsigned char *in, int inl)
+{
+    return EVP_EncryptUpdate_multi(&ctx, &out, outl, &in, &inl, 1);
+}
+
+static void
+encryptBlock(EVP_CIPHER_CTX *c, const uint8_t *in, uint8_t *out)
+{
+    struct Aes128CbcEnc *ctx = (struct Aes128CbcEnc *)c->data;
+    size_t length = 16;
+    Aes128CbcEnc_encrypt(&ctx, &in, &out, &length, 1);
+}
+
+/*
+    Completes the partial block of each context first, and then encrypts the
+    remaining whole blocks of all the contexts at once. The rest of the
+    input is kept for the next call.
+*/
+int
+EVP_EncryptUpdate_multi(EVP_CIPHER_CTX *const *ctx,
+    unsigned char *const *out, int *outl,
+    const unsigned char *const *in, const int *inl, int count)
+{
+    if (count < 0) {
+        return 0;
+    }
+    for (int k = 0; k < count; ++k) {
+        if (!ctx[k]->encrypting || ctx[k]->data == NULL || inl[k] < 0) {
+            return 0;
+        }
+    }
+    struct Aes128CbcEnc *lane[AES128CBC_LANES];
+    const uint8_t *laneIn[AES128CBC_LANES];
+    uint8_t *laneOut[AES128CBC_LANES];
+    size_t laneLength[AES128CBC_LANES];
+    for (int base = 0; base < count; base += AES128CBC_LANES) {
+        int n = count - base;
+        if (n > AES128CBC_LANES) {
+            n = AES128CBC_LANES;
+        }
+        for (int j = 0; j < n; ++j) {
+            EVP_CIPHER_CTX *c = ctx[base + j];
+            const uint8_t *p = in[base + j];
+            uint8_t *o = out[base + j];
+            size_t size = (size_t)inl[base + j];
+            int outSize = 0;
+            if (c->bufferLength > 0) {
+                size_t m = 16 - c->bufferLength;
+                if (m > size) {
+                    m = size;
+                }
+                MEMCPY(c->padding + c->bufferLength, p, m);
+                c->bufferLength += (uint32_t)m;
+                p += m;
+                size -= m;
+                if (c->bufferLength == 16) {
+                    encryptBlock(c, c->padding, o);
+                    c->bufferLength = 0;
+                    o += 16;
+                    outSize += 16;
+                }
+            }
+            size_t mainSize = size & ~(size_t)15;
+            size_t rest = size - mainSize;
+            if (rest > 0) {
+                MEMCPY(c->padding, p + mainSize, rest);
+                c->bufferLength = (uint32_t)rest;
+            }
+            lane[j] = (struct Aes128CbcEnc *)c->data;
+            laneIn[j] = p;
+            laneOut[j] = o;
+            laneLength[j] = mainSize;
+            outl[base + j] = outSize + (int)mainSize;
+        }
+        Aes128CbcEnc_encrypt(lane, laneIn, laneOut, laneLength, (size_t)n);
+    }
+    return 1;
+}
+
+int
+EVP_EncryptFinal_ex(EVP_CIPHER_CTX *ctx, unsigned char *out, int *outl)
+{
+    if (!ctx->encrypting || ctx->data == NULL) {
+        return 0;
+    }
+    uint32_t n = ctx->bufferLength;
+    if (!ctx->paddingEnabled) {
+        if (n != 0) {
+            return 0;
+        }
+        *outl = 0;
+        return 1;
+    }
+    uint8_t padValue = (uint8_t)(16 - n);
+    memset(ctx->padding + n, padValue, padValue);
+    encryptBlock(ctx, ctx->padding, out);
+    ctx->bufferLength = 0;
+    *outl = 16;
+    return 1;
+}
+
+int
+EVP_CIPHER_CTX_enable_crc32c(EVP_CIPHER_CTX *ctx)
+{
+    if (ctx->cipher == NULL || ctx->encrypting
+            || ctx->cipher->update != aesUpdate) {
+        return 0;
+    }
+    ctx->crc32c = Crc32c_select();
+    ctx->crc = 0;
+    return 1;
+}
+
+int
+EVP_DecryptFinal_crc32c(EVP_CIPHER_CTX *ctx, unsigned char *outm, int *outl,
+    unsigned int *crc)
+{
+    if (ctx->crc32c == NULL) {
+        return 0;
+    }
+    if (!EVP_DecryptFinal_ex(ctx, outm, outl)) {
+        return 0;
+    }
+    *crc = ctx->crc;
+    return 1;
+}
+
+/*
+    The layout of the exported state, version 1:
+
+    0       version
+    1       cipher (STATE_CIPHER_*)
+    2       flags (STATE_*)
+    3       offset of the unused key stream (CTR), zero otherwise
+    4..7    CRC32C (little endian)
+    8..23   IV (CBC) or counter (CTR)
+    24..39  block held back (CBC, ECB) or key stream (CTR)
+*/
+#define STATE_VERSION 1
+#define STATE_HAS_PADDING 0x01
+#define STATE_PADDING_ENABLED 0x02
+#define STATE_CRC32C 0x04
+
+enum {
+    STATE_CIPHER_AES_128_CBC = 1,
+    STATE_CIPHER_AES_128_ECB,
+    STATE_CIPHER_AES_192_CBC,
+    STATE_CIPHER_AES_256_CBC,
+    STATE_CIPHER_AES_128_CTR,
+};
+
+static uint8_t
+stateCipher(const EVP_CIPHER *cipher)
+{
+    return (cipher == &aes128cbc) ? STATE_CIPHER_AES_128_CBC
+        : (cipher == &aes128ecb) ? STATE_CIPHER_AES_128_ECB
+        : (cipher == &aes192cbc) ? STATE_CIPHER_AES_192_CBC
+        : (cipher == &aes256cbc) ? STATE_CIPHER_AES_256_CBC
+        : (cipher == &aes128ctr) ? STATE_CIPHER_AES_128_CTR
+        : 0;
+}
+
+/*
+    Returns the IV (or the counter) of the kernel context, which the ECB
+    mode has but does not use.
+*/
+static uint8_t *
+stateIv(EVP_CIPHER_CTX *c)
+{
+    if (c->cipher == &aes192cbc || c->cipher == &aes256cbc) {
+        return ((struct AesCbc *)c->data)->iv.data;
+    }
+    if (c->cipher == &aes128ctr) {
+        return ((struct CtrContext *)c->data)->ctr.counter.data;
+    }
+    return ((struct Aes128Cbc *)c->data)->iv.data;
+}
+
+int
+EVP_CIPHER_CTX_export_state(EVP_CIPHER_CTX *ctx, unsigned char *out,
+    int *outl)
+{
+    if (ctx->cipher == NULL || ctx->encrypting) {
+        return 0;
+    }
+    memset(out, 0, EVP_CIPHER_CTX_STATE_LENGTH);
+    out[0] = STATE_VERSION;
+    out[1] = stateCipher(ctx->cipher);
+    out[2] = (uint8_t)((ctx->hasPadding ? STATE_HAS_PADDING : 0)
+        | (ctx->paddingEnabled ? STATE_PADDING_ENABLED : 0)
+        | ((ctx->crc32c != NULL) ? STATE_CRC32C : 0));
+    for (int k = 0; k < 4; ++k) {
+        out[4 + k] = (uint8_t)(ctx->crc >> (8 * k));
+    }
+    MEMCPY(out + 8, stateIv(ctx), 16);
+    if (ctx->cipher == &aes128ctr) {
+        struct CtrContext *c = (struct CtrContext *)ctx->data;
+        out[3] = (uint8_t)c->keyStreamOffset;
+        MEMCPY(out + 24, c->keyStream, 16);
+    } else if (ctx->hasPadding) {
+        MEMCPY(out + 24, ctx->padding, 16);
+    }
+    *outl = EVP_CIPHER_CTX_STATE_LENGTH;
+    return 1;
+}
+
+int
+EVP_CIPHER_CTX_import_state(EVP_CIPHER_CTX *ctx, const unsigned char *in,
+    int inl)
+{
+    if (ctx->cipher == NULL || ctx->encrypting
+            || inl != EVP_CIPHER_CTX_STATE_LENGTH
+            || in[0] != STATE_VERSION
+            || in[1] != stateCipher(ctx->cipher)
+            || (in[2] & ~(STATE_HAS_PADDING | STATE_PADDING_ENABLED
+                | STATE_CRC32C)) != 0
+            || in[3] > 16) {
+        return 0;
+    }
+    uint32_t flags = in[2];
+    int isCtr = (ctx->cipher == &aes128ctr);
+    if (isCtr
+            ? (flags & (STATE_HAS_PADDING | STATE_CRC32C)) != 0
+            : in[3] != 0) {
+        return 0;
+    }
+    MEMCPY(stateIv(ctx), in + 8, 16);
+    if (isCtr) {
+        struct CtrContext *c = (struct CtrContext *)ctx->data;
+        c->keyStreamOffset = in[3];
+        MEMCPY(c->keyStream, in + 24, 16);
+    } else {
+        MEMCPY(ctx->padding, in + 24, 16);
+    }
+    ctx->hasPadding = (flags & STATE_HAS_PADDING) != 0;
+    ctx->paddingEnabled = (flags & STATE_PADDING_ENABLED) != 0;
+    ctx->crc32c = (flags & STATE_CRC32C) ? Crc32c_select() : NULL;
+    ctx->crc = 0;
+    for (int k = 0; k < 4; ++k) {
+        ctx->crc |= (uint32_t)in[4 + k] << (8 * k);
+    }
+    return 1;
+}
+
+#if STATS_ENABLED
+static void
+toPublicStats(EVP_STATS *out, uint64_t bytesDecrypted, uint64_t updateCalls,
+    uint64_t kernelNanoseconds, uint64_t totalNanoseconds,
+    uint64_t keyExpansions, uint64_t allocations)
+{
+    out->bytesDecrypted = bytesDecrypted;
+    out->updateCalls = updateCalls;
+    out->averageUpdateSize = (updateCalls > 0)
+        ? bytesDecrypted / updateCalls
+        : 0;
+    out->kernelNanoseconds = kernelNanoseconds;
+    out->bookkeepingNanoseconds = (totalNanoseconds > kernelNanoseconds)
+        ? totalNanoseconds - kernelNanoseconds
+        : 0;
+    out->keyExpansions = keyExpansions;
+    out->allocations = allocations;
+}
+#endif
+
+int
+EVP_CIPHER_CTX_get_stats(EVP_CIPHER_CTX *ctx, EVP_STATS *stats, int reset)
+{
+#if STATS_ENABLED
+    const struct Stats *s = &ctx->stats;
+    toPublicStats(stats, s->bytesDecrypted, s->updateCalls,
+        s->kernelNanoseconds, s->totalNanoseconds, s->keyExpansions,
+        s->allocations);
+    if (reset) {
+        ctx->stats = (struct Stats){0};
+    }
+    return 1;
+#else
+    (void)ctx;
+    (void)reset;
+    *stats = (EVP_STATS){0};
+    return 0;
+#endif
+}
+
+int
+EVP_get_global_stats(EVP_STATS *stats, int reset)
+{
+#if STATS_ENABLED
+    struct AtomicStats *g = &globalStats;
+    if (reset) {
+        toPublicStats(stats,
+            atomic_exchange_explicit(&g->bytesDecrypted, 0,
+                memory_order_relaxed),
+            atomic_exchange_explicit(&g->updateCalls, 0,
+                memory_order_relaxed),
+            atomic_exchange_explicit(&g->kernelNanoseconds, 0,
+                memory_order_relaxed),
+            atomic_exchange_explicit(&g->totalNanoseconds, 0,
+                memory_order_relaxed),
+            atomic_exchange_explicit(&g->keyExpansions, 0,
+                memory_order_relaxed),
+            atomic_exchange_explicit(&g->allocations, 0,
+                memory_order_relaxed));
+    } else {
+        toPublicStats(stats,
+            atomic_load_explicit(&g->bytesDecrypted, memory_order_relaxed),
+            atomic_load_explicit(&g->updateCalls, memory_order_relaxed),
+            atomic_load_explicit(&g->kernelNanoseconds, memory_order_relaxed),
+            atomic_load_explicit(&g->totalNanoseconds, memory_order_relaxed),
+            atomic_load_explicit(&g->keyExpansions, memory_order_relaxed),
+            atomic_load_explicit(&g->allocations, memory_order_relaxed));
+    }
+    return 1;
+#else
+    (void)reset;
+    *stats = (EVP_STATS){0};
+    return 0;
+#endif
 }
@@ -0,0 +1,38 @@
+#ifndef keySchedule_H
+#define keySchedule_H
+
+/*
+    The key expansion of AES-128, AES-192, and AES-256 (FIPS 197, 5.2).
+    The caller must include "sbox.h" and "rcon.h" before this header.
+*/
+
+#include <string.h>
+
+static void
+expandKey(const uint8_t *key, uint32_t keyWords,
+    struct Aes128Cbc_Key *round, uint32_t rounds)
+{
+    uint32_t w[4 * 15];
+    uint32_t total = 4 * (rounds + 1);
+
+    memcpy(w, key, keyWords * 4);
+    for (uint32_t i = keyWords; i < total; ++i) {
+        uint32_t t = w[i - 1];
+        if (i % keyWords == 0) {
+            t = (t >> 8) | (t << 24);
+            t = (SBOX[(uint8_t)t] ^ RCON[i / keyWords - 1])
+                | (SBOX[(uint8_t)(t >> 8)] << 8)
+                | (SBOX[(uint8_t)(t >> 16)] << 16)
+                | ((uint32_t)SBOX[(uint8_t)(t >> 24)] << 24);
+        } else if (keyWords > 6 && i % keyWords == 4) {
+            t = SBOX[(uint8_t)t]
+                | (SBOX[(uint8_t)(t >> 8)] << 8)
+                | (SBOX[(uint8_t)(t >> 16)] << 16)
+                | ((uint32_t)SBOX[(uint8_t)(t >> 24)] << 24);
+        }
+        w[i] = w[i - keyWords] ^ t;
+    }
+    memcpy(round, w, total * 4);
+}
+
+#endif
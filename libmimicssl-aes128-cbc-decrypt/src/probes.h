@@ -0,0 +1,40 @@
+#ifndef probes_H
+#define probes_H
+
+/*
+    Static tracepoints (USDT) for the "mimicssl" provider. They are compiled
+    in only when MIMICSSL_ENABLE_PROBES is defined to a non-zero value and
+    <sys/sdt.h> is available; a compiled-in probe that nobody attaches to is
+    a single NOP instruction.
+
+    Probes:
+        decrypt_init(ctx, result)
+        decrypt_update_entry(ctx, inl)
+        decrypt_update_return(ctx, inl, outl, result)
+        decrypt_final(ctx, outl, result)
+        backend(name, forced)
+*/
+
+#if defined(MIMICSSL_ENABLE_PROBES) && MIMICSSL_ENABLE_PROBES \
+    && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_ENABLED 1
+#endif
+#endif
+
+#if defined(PROBES_ENABLED)
+
+#define PROBE2(name, a, b) DTRACE_PROBE2(mimicssl, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(mimicssl, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(mimicssl, name, a, b, c, d)
+
+#else
+
+#define PROBE2(name, a, b) ((void)0)
+#define PROBE3(name, a, b, c) ((void)0)
+#define PROBE4(name, a, b, c, d) ((void)0)
+
+#endif
+
+#endif
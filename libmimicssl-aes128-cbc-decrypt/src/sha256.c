@@ -0,0 +1,198 @@
+/*
+    References:
+
+    https://nvlpubs.nist.gov/nistpubs/FIPS/NIST.FIPS.180-4.pdf
+    https://www.rfc-editor.org/rfc/rfc2104
+*/
+
+#include <string.h>
+
+#include "sha256.h"
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+static uint32_t
+rotr(uint32_t x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static uint32_t
+load32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24)
+        | ((uint32_t)p[1] << 16)
+        | ((uint32_t)p[2] << 8)
+        | (uint32_t)p[3];
+}
+
+static void
+store32(uint32_t v, uint8_t *p)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static void
+compress(uint32_t *state, const uint8_t *block)
+{
+    uint32_t w[64];
+    for (int t = 0; t < 16; ++t) {
+        w[t] = load32(block + t * 4);
+    }
+    for (int t = 16; t < 64; ++t) {
+        uint32_t s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18)
+            ^ (w[t - 15] >> 3);
+        uint32_t s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19)
+            ^ (w[t - 2] >> 10);
+        w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+    }
+    uint32_t a = state[0];
+    uint32_t b = state[1];
+    uint32_t c = state[2];
+    uint32_t d = state[3];
+    uint32_t e = state[4];
+    uint32_t f = state[5];
+    uint32_t g = state[6];
+    uint32_t h = state[7];
+    for (int t = 0; t < 64; ++t) {
+        uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + K[t] + w[t];
+        uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void
+Sha256_init(struct Sha256 *ctx)
+{
+    static const uint32_t H0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, H0, sizeof(H0));
+    ctx->length = 0;
+}
+
+void
+Sha256_update(struct Sha256 *ctx, const void *data, size_t length)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    size_t used = (size_t)(ctx->length % 64);
+    ctx->length += length;
+    if (used > 0) {
+        size_t n = 64 - used;
+        if (n > length) {
+            memcpy(ctx->buffer + used, p, length);
+            return;
+        }
+        memcpy(ctx->buffer + used, p, n);
+        compress(ctx->state, ctx->buffer);
+        p += n;
+        length -= n;
+    }
+    for (; length >= 64; length -= 64) {
+        compress(ctx->state, p);
+        p += 64;
+    }
+    if (length > 0) {
+        memcpy(ctx->buffer, p, length);
+    }
+}
+
+void
+Sha256_final(struct Sha256 *ctx, uint8_t *digest)
+{
+    uint64_t bits = ctx->length * 8;
+    size_t used = (size_t)(ctx->length % 64);
+    ctx->buffer[used] = 0x80;
+    ++used;
+    if (used > 56) {
+        memset(ctx->buffer + used, 0, 64 - used);
+        compress(ctx->state, ctx->buffer);
+        used = 0;
+    }
+    memset(ctx->buffer + used, 0, 56 - used);
+    store32((uint32_t)(bits >> 32), ctx->buffer + 56);
+    store32((uint32_t)bits, ctx->buffer + 60);
+    compress(ctx->state, ctx->buffer);
+    for (int k = 0; k < 8; ++k) {
+        store32(ctx->state[k], digest + k * 4);
+    }
+}
+
+void
+HmacSha256_init(struct HmacSha256 *ctx, const void *key, size_t keyLength)
+{
+    uint8_t block[64];
+    memset(block, 0, sizeof(block));
+    if (keyLength > 64) {
+        struct Sha256 h;
+        Sha256_init(&h);
+        Sha256_update(&h, key, keyLength);
+        Sha256_final(&h, block);
+    } else if (keyLength > 0) {
+        memcpy(block, key, keyLength);
+    }
+    for (int k = 0; k < 64; ++k) {
+        block[k] ^= 0x36;
+    }
+    Sha256_init(&ctx->inner);
+    Sha256_update(&ctx->inner, block, 64);
+    for (int k = 0; k < 64; ++k) {
+        block[k] ^= 0x36 ^ 0x5c;
+    }
+    Sha256_init(&ctx->outer);
+    Sha256_update(&ctx->outer, block, 64);
+    memset(block, 0, sizeof(block));
+}
+
+void
+HmacSha256_update(struct HmacSha256 *ctx, const void *data, size_t length)
+{
+    Sha256_update(&ctx->inner, data, length);
+}
+
+void
+HmacSha256_final(struct HmacSha256 *ctx, uint8_t *tag)
+{
+    uint8_t digest[32];
+    Sha256_final(&ctx->inner, digest);
+    Sha256_update(&ctx->outer, digest, sizeof(digest));
+    Sha256_final(&ctx->outer, tag);
+}
@@ -0,0 +1,40 @@
+#ifndef sha256_H
+#define sha256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    SHA-256 (FIPS 180-4) and HMAC-SHA256 (RFC 2104).
+*/
+
+struct Sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[64];
+};
+
+struct HmacSha256 {
+    struct Sha256 inner;
+    struct Sha256 outer;
+};
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+void Sha256_init(struct Sha256 *ctx);
+void Sha256_update(struct Sha256 *ctx, const void *data, size_t length);
+void Sha256_final(struct Sha256 *ctx, uint8_t *digest);
+
+void HmacSha256_init(struct HmacSha256 *ctx, const void *key,
+    size_t keyLength);
+void HmacSha256_update(struct HmacSha256 *ctx, const void *data,
+    size_t length);
+void HmacSha256_final(struct HmacSha256 *ctx, uint8_t *tag);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef stats_H
+#define stats_H
+
+/*
+    Opt-in performance counters. Unless MIMICSSL_ENABLE_STATS is defined to
+    a non-zero value, every STATS_* macro expands to nothing, so the hot path
+    is exactly the same as the one without instrumentation.
+*/
+
+#if defined(MIMICSSL_ENABLE_STATS) && MIMICSSL_ENABLE_STATS
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+struct Stats {
+    uint64_t bytesDecrypted;
+    uint64_t updateCalls;
+    uint64_t kernelNanoseconds;
+    uint64_t totalNanoseconds;
+    uint64_t keyExpansions;
+    uint64_t allocations;
+};
+
+struct AtomicStats {
+    _Atomic uint64_t bytesDecrypted;
+    _Atomic uint64_t updateCalls;
+    _Atomic uint64_t kernelNanoseconds;
+    _Atomic uint64_t totalNanoseconds;
+    _Atomic uint64_t keyExpansions;
+    _Atomic uint64_t allocations;
+};
+
+static inline uint64_t
+Stats_now(void)
+{
+#if defined(_WIN32)
+    LARGE_INTEGER count;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t)(count.QuadPart / frequency.QuadPart) * 1000000000u
+        + (uint64_t)(count.QuadPart % frequency.QuadPart) * 1000000000u
+            / (uint64_t)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#define STATS_ENABLED 1
+#define STATS_CLOCK(t) uint64_t t = Stats_now()
+#define STATS_ADD(s, g, field, value) \
+    do { \
+        uint64_t v_ = (value); \
+        (s)->field += v_; \
+        atomic_fetch_add_explicit(&(g)->field, v_, memory_order_relaxed); \
+    } while (0)
+
+#else
+
+#define STATS_ENABLED 0
+#define STATS_CLOCK(t) ((void)0)
+#define STATS_ADD(s, g, field, value) ((void)0)
+
+#endif
+
+#endif
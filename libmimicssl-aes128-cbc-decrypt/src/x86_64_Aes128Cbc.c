@@ -15,10 +15,39 @@
 #include <emmintrin.h>
 #include <pmmintrin.h>
 #include <wmmintrin.h>
+#include <xmmintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
 #include "Aes128Cbc.h"
 
 #include "sbox.h"
 #include "rcon.h"
+#include "ctr.h"
+#include "keySchedule.h"
+
+static int
+isSupported(void)
+{
+    // CPUID.01H:ECX.SSE3[bit 0] and CPUID.01H:ECX.AESNI[bit 25]
+    const uint32_t mask = (1u << 0) | (1u << 25);
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    uint32_t ecx = (uint32_t)info[2];
+#else
+    unsigned int eax;
+    unsigned int ebx;
+    unsigned int ecx;
+    unsigned int edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return 0;
+    }
+#endif
+    return (ecx & mask) == mask;
+}
 
 static void
 keyExpansion(const struct Aes128Cbc_Key *key, struct Aes128Cbc_RoundKey *out)
@@ -51,18 +80,23 @@ keyExpansion(const struct Aes128Cbc_Key *key, struct Aes128Cbc_RoundKey *out)
 }
 
 static void
-postKeyExpansion(struct Aes128Cbc_RoundKey *roundKey)
+invMixRoundKeys(struct Aes128Cbc_Key *round, uint32_t rounds)
 {
-    for (int k = 1; k < 10; ++k) {
-        struct Aes128Cbc_Key *key = &roundKey->round[k];
-        __m128i *data = (__m128i *)key->data;
+    for (uint32_t k = 1; k < rounds; ++k) {
+        __m128i *data = (__m128i *)round[k].data;
         __m128i key128 = _mm_aesimc_si128(_mm_lddqu_si128(data));
         _mm_storeu_si128(data, key128);
     }
 }
 
-void
-Aes128Cbc_init(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
+static void
+postKeyExpansion(struct Aes128Cbc_RoundKey *roundKey)
+{
+    invMixRoundKeys(roundKey->round, 10);
+}
+
+static void
+cbcInit(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
     const struct Aes128Cbc_Iv *iv)
 {
     keyExpansion(key, &ctx->roundKey);
@@ -70,32 +104,401 @@ Aes128Cbc_init(struct Aes128Cbc *ctx, const struct Aes128Cbc_Key *key,
     ctx->iv = *iv;
 }
 
+static inline __m128i
+nextRoundKey(__m128i key, __m128i assist)
+{
+    assist = _mm_shuffle_epi32(assist, 0xff);
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, assist);
+}
+
+/*
+    The immediate operand of AESKEYGENASSIST must be a constant, so the
+    rounds are unrolled.
+*/
+#define EXPAND_ROUND(r, rcon) \
+    for (size_t j = 0; j < count; ++j) { \
+        k[j] = nextRoundKey(k[j], _mm_aeskeygenassist_si128(k[j], rcon)); \
+        __m128i key128 = (r < 10) ? _mm_aesimc_si128(k[j]) : k[j]; \
+        _mm_storeu_si128((__m128i *)ctx[j]->roundKey.round[r].data, key128); \
+    }
+
+/*
+    Expands the keys with AESKEYGENASSIST instead of the S-box table.
+    The keys are independent of each other, so their rounds are interleaved.
+*/
+static void
+cbcInitMany(struct Aes128Cbc *const *ctx,
+    const struct Aes128Cbc_Key *key, const struct Aes128Cbc_Iv *iv,
+    size_t count)
+{
+    __m128i k[AES128CBC_LANES];
+    for (size_t j = 0; j < count; ++j) {
+        k[j] = _mm_lddqu_si128((const __m128i *)key[j].data);
+        _mm_storeu_si128((__m128i *)ctx[j]->roundKey.round[0].data, k[j]);
+        ctx[j]->iv = iv[j];
+    }
+    EXPAND_ROUND(1, 0x01);
+    EXPAND_ROUND(2, 0x02);
+    EXPAND_ROUND(3, 0x04);
+    EXPAND_ROUND(4, 0x08);
+    EXPAND_ROUND(5, 0x10);
+    EXPAND_ROUND(6, 0x20);
+    EXPAND_ROUND(7, 0x40);
+    EXPAND_ROUND(8, 0x80);
+    EXPAND_ROUND(9, 0x1b);
+    EXPAND_ROUND(10, 0x36);
+}
+
+#undef EXPAND_ROUND
+
+/*
+    How far ahead the input is prefetched, in bytes. The hardware
+    prefetchers do not cross page boundaries, so this keeps the next page
+    coming while the current one is decrypted.
+*/
+#define PREFETCH_DISTANCE 512
+
+static inline void
+prefetchInput(const uint8_t *in, size_t length)
+{
+    if (length >= 128 + PREFETCH_DISTANCE) {
+        _mm_prefetch((const char *)(in + PREFETCH_DISTANCE), _MM_HINT_T0);
+        _mm_prefetch((const char *)(in + PREFETCH_DISTANCE + 64),
+            _MM_HINT_T0);
+    }
+}
+
+/*
+    Loads the round keys once per call, with aligned loads since they start
+    at a cache line. With the number of rounds constant, they stay in the
+    registers (or at worst in the stack) for the whole call.
+*/
+static inline void
+loadRoundKeys(__m128i *key, const struct Aes128Cbc_Key *round,
+    uint32_t rounds)
+{
+    for (uint32_t k = 0; k <= rounds; ++k) {
+        key[k] = _mm_load_si128((const __m128i *)round[k].data);
+    }
+}
+
+static inline __m128i
+decryptBlock(__m128i state, const __m128i *key, uint32_t rounds)
+{
+    state = _mm_xor_si128(state, key[rounds]);
+    for (uint32_t k = rounds - 1; k > 0; --k) {
+        state = _mm_aesdec_si128(state, key[k]);
+    }
+    return _mm_aesdeclast_si128(state, key[0]);
+}
+
+/*
+    Decrypts a single block. The kernels below load the round keys once
+    per call instead.
+*/
+static inline __m128i
+eqInvCipher(__m128i state, const struct Aes128Cbc_Key *round,
+    uint32_t rounds)
+{
+    __m128i key[15];
+    loadRoundKeys(key, round, rounds);
+    return decryptBlock(state, key, rounds);
+}
+
+/*
+    Decrypts 8 blocks at a time; unlike encryption, the CBC decryption of
+    the blocks is independent of each other. The callers pass the number of
+    rounds as a constant, so that each key size gets its own specialized
+    copy of this function.
+*/
+static inline void
+decryptBlocks(const struct Aes128Cbc_Key *round, uint32_t rounds,
+    uint8_t *iv, const uint8_t *in, size_t length, uint8_t *out)
+{
+    __m128i key[15];
+    loadRoundKeys(key, round, rounds);
+    __m128i iv128 = _mm_lddqu_si128((const __m128i *)iv);
+    while (length >= 128) {
+        __m128i c[8];
+        __m128i s[8];
+        prefetchInput(in, length);
+        for (int j = 0; j < 8; ++j) {
+            c[j] = _mm_lddqu_si128((const __m128i *)(in + j * 16));
+            s[j] = _mm_xor_si128(c[j], key[rounds]);
+        }
+        for (uint32_t k = rounds - 1; k > 0; --k) {
+            for (int j = 0; j < 8; ++j) {
+                s[j] = _mm_aesdec_si128(s[j], key[k]);
+            }
+        }
+        for (int j = 0; j < 8; ++j) {
+            s[j] = _mm_aesdeclast_si128(s[j], key[0]);
+        }
+        _mm_storeu_si128((__m128i *)out, _mm_xor_si128(s[0], iv128));
+        for (int j = 1; j < 8; ++j) {
+            _mm_storeu_si128((__m128i *)(out + j * 16),
+                _mm_xor_si128(s[j], c[j - 1]));
+        }
+        iv128 = c[7];
+        in += 128;
+        out += 128;
+        length -= 128;
+    }
+    while (length > 0) {
+        __m128i in128 = _mm_lddqu_si128((const __m128i *)in);
+        __m128i state = decryptBlock(in128, key, rounds);
+        _mm_storeu_si128((__m128i *)out, _mm_xor_si128(state, iv128));
+        iv128 = in128;
+        in += 16;
+        out += 16;
+        length -= 16;
+    }
+    _mm_storeu_si128((__m128i *)iv, iv128);
+}
+
+static void
+cbcDecrypt(struct Aes128Cbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    decryptBlocks(ctx->roundKey.round, 10, ctx->iv.data,
+        (const uint8_t *)data, length, (uint8_t *)output);
+}
+
+/*
+    Decrypts 8 blocks at a time, like decryptBlocks() but without chaining.
+*/
+static void
+ecbDecrypt(struct Aes128Cbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    const uint8_t *in = (const uint8_t *)data;
+    uint8_t *out = (uint8_t *)output;
+    __m128i key[11];
+    loadRoundKeys(key, ctx->roundKey.round, 10);
+    while (length >= 128) {
+        __m128i s[8];
+        prefetchInput(in, length);
+        for (int j = 0; j < 8; ++j) {
+            s[j] = _mm_xor_si128(
+                _mm_lddqu_si128((const __m128i *)(in + j * 16)), key[10]);
+        }
+        for (uint32_t k = 9; k > 0; --k) {
+            for (int j = 0; j < 8; ++j) {
+                s[j] = _mm_aesdec_si128(s[j], key[k]);
+            }
+        }
+        for (int j = 0; j < 8; ++j) {
+            _mm_storeu_si128((__m128i *)(out + j * 16),
+                _mm_aesdeclast_si128(s[j], key[0]));
+        }
+        in += 128;
+        out += 128;
+        length -= 128;
+    }
+    while (length > 0) {
+        __m128i in128 = _mm_lddqu_si128((const __m128i *)in);
+        _mm_storeu_si128((__m128i *)out, decryptBlock(in128, key, 10));
+        in += 16;
+        out += 16;
+        length -= 16;
+    }
+}
+
+static void
+wideInit(struct AesCbc *ctx, const uint8_t *key, size_t keyLength,
+    const struct Aes128Cbc_Iv *iv)
+{
+    uint32_t keyWords = (uint32_t)(keyLength / 4);
+    ctx->rounds = keyWords + 6;
+    expandKey(key, keyWords, ctx->roundKey.round, ctx->rounds);
+    invMixRoundKeys(ctx->roundKey.round, ctx->rounds);
+    ctx->iv = *iv;
+}
+
+static void
+wideDecrypt(struct AesCbc *ctx, const void *data,
+    size_t length, void *output)
+{
+    if (ctx->rounds == 12) {
+        decryptBlocks(ctx->roundKey.round, 12, ctx->iv.data,
+            (const uint8_t *)data, length, (uint8_t *)output);
+    } else {
+        decryptBlocks(ctx->roundKey.round, 14, ctx->iv.data,
+            (const uint8_t *)data, length, (uint8_t *)output);
+    }
+}
+
+static void
+ctrInit(struct Aes128Ctr *ctx, const struct Aes128Cbc_Key *key,
+    const struct Aes128Cbc_Iv *counter)
+{
+    keyExpansion(key, &ctx->roundKey);
+    ctx->counter = *counter;
+}
+
+static uint64_t
+byteSwap64(uint64_t v)
+{
+#if defined(_MSC_VER)
+    return _byteswap_uint64(v);
+#else
+    return __builtin_bswap64(v);
+#endif
+}
+
 static __m128i
-eqInvCipher(__m128i state, const struct Aes128Cbc_RoundKey *roundKey)
+toCounterBlock(const struct Ctr_Counter *c)
 {
-    const struct Aes128Cbc_Key *round = roundKey->round;
+    return _mm_set_epi64x((long long)byteSwap64(c->low),
+        (long long)byteSwap64(c->high));
+}
 
-    state = _mm_xor_si128(state, _mm_lddqu_si128((const __m128i *)round[10].data));
-    for (uint32_t k = 9; k > 0; --k) {
-        state = _mm_aesdec_si128(state, _mm_lddqu_si128((const __m128i *)round[k].data));
+static inline __m128i
+encryptBlock(__m128i state, const __m128i *key)
+{
+    state = _mm_xor_si128(state, key[0]);
+    for (uint32_t k = 1; k < 10; ++k) {
+        state = _mm_aesenc_si128(state, key[k]);
     }
-    return _mm_aesdeclast_si128(state, _mm_lddqu_si128((const __m128i *)round[0].data));
+    return _mm_aesenclast_si128(state, key[10]);
 }
 
-void Aes128Cbc_decrypt(struct Aes128Cbc *ctx, const void *data,
+/*
+    Encrypts 8 counter blocks at a time so that the independent AESENC
+    instructions fill the pipeline of the AES unit.
+*/
+static void
+ctrDecrypt(struct Aes128Ctr *ctx, const void *data,
     size_t length, void *output)
 {
     const uint8_t *in = (const uint8_t *)data;
     uint8_t *out = (uint8_t *)output;
-    __m128i iv128 = _mm_lddqu_si128((const __m128i *)ctx->iv.data);
+    struct Ctr_Counter counter = Ctr_load(ctx->counter.data);
+    __m128i key[11];
+    loadRoundKeys(key, ctx->roundKey.round, 10);
+    while (length >= 128) {
+        __m128i s[8];
+        prefetchInput(in, length);
+        for (int j = 0; j < 8; ++j) {
+            s[j] = _mm_xor_si128(toCounterBlock(&counter), key[0]);
+            Ctr_increment(&counter);
+        }
+        for (uint32_t k = 1; k < 10; ++k) {
+            for (int j = 0; j < 8; ++j) {
+                s[j] = _mm_aesenc_si128(s[j], key[k]);
+            }
+        }
+        for (int j = 0; j < 8; ++j) {
+            s[j] = _mm_aesenclast_si128(s[j], key[10]);
+        }
+        for (int j = 0; j < 8; ++j) {
+            __m128i in128 = _mm_lddqu_si128((const __m128i *)(in + j * 16));
+            _mm_storeu_si128((__m128i *)(out + j * 16),
+                _mm_xor_si128(in128, s[j]));
+        }
+        in += 128;
+        out += 128;
+        length -= 128;
+    }
     while (length > 0) {
+        __m128i state = encryptBlock(toCounterBlock(&counter), key);
+        Ctr_increment(&counter);
         __m128i in128 = _mm_lddqu_si128((const __m128i *)in);
-        __m128i state = eqInvCipher(in128, &ctx->roundKey);
-        _mm_storeu_si128((__m128i *)out, _mm_xor_si128(state, iv128));
-        iv128 = in128;
+        _mm_storeu_si128((__m128i *)out, _mm_xor_si128(in128, state));
         in += 16;
         out += 16;
         length -= 16;
     }
-    _mm_storeu_si128((__m128i *)ctx->iv.data, iv128);
+    Ctr_store(&counter, ctx->counter.data);
 }
+
+static void
+cbcEncInit(struct Aes128CbcEnc *ctx, const struct Aes128Cbc_Key *key,
+    const struct Aes128Cbc_Iv *iv)
+{
+    keyExpansion(key, &ctx->roundKey);
+    ctx->iv = *iv;
+}
+
+/*
+    A single stream is serial, so its round keys are loaded once and kept
+    in the registers. The lanes of different streams have their own round
+    keys, which do not fit in the registers together.
+*/
+static void
+cbcEncryptSingle(struct Aes128CbcEnc *ctx, const uint8_t *in, uint8_t *out,
+    size_t length)
+{
+    __m128i key[11];
+    loadRoundKeys(key, ctx->roundKey.round, 10);
+    __m128i state = _mm_lddqu_si128((const __m128i *)ctx->iv.data);
+    for (size_t offset = 0; offset < length; offset += 16) {
+        __m128i in128 = _mm_lddqu_si128((const __m128i *)(in + offset));
+        state = encryptBlock(_mm_xor_si128(state, in128), key);
+        _mm_storeu_si128((__m128i *)(out + offset), state);
+    }
+    _mm_storeu_si128((__m128i *)ctx->iv.data, state);
+}
+
+/*
+    The CBC encryption of a stream is serial, but the AESENC instructions of
+    different streams are independent of each other, so this encrypts up to
+    8 streams in lockstep to fill the pipeline of the AES unit. The round
+    keys of all the lanes do not fit in the registers together, so they
+    are loaded once into an aligned local schedule instead.
+*/
+static void
+cbcEncrypt(struct Aes128CbcEnc *const *ctx,
+    const uint8_t *const *data, uint8_t *const *output,
+    size_t count, size_t length)
+{
+    if (count == 1) {
+        cbcEncryptSingle(ctx[0], data[0], output[0], length);
+        return;
+    }
+    __m128i key[AES128CBC_LANES][11];
+    __m128i s[AES128CBC_LANES];
+    for (size_t j = 0; j < count; ++j) {
+        loadRoundKeys(key[j], ctx[j]->roundKey.round, 10);
+        s[j] = _mm_lddqu_si128((const __m128i *)ctx[j]->iv.data);
+    }
+    for (size_t offset = 0; offset < length; offset += 16) {
+        for (size_t j = 0; j < count; ++j) {
+            __m128i in128 = _mm_lddqu_si128(
+                (const __m128i *)(data[j] + offset));
+            s[j] = _mm_xor_si128(_mm_xor_si128(s[j], in128), key[j][0]);
+        }
+        for (uint32_t k = 1; k < 10; ++k) {
+            for (size_t j = 0; j < count; ++j) {
+                s[j] = _mm_aesenc_si128(s[j], key[j][k]);
+            }
+        }
+        for (size_t j = 0; j < count; ++j) {
+            s[j] = _mm_aesenclast_si128(s[j], key[j][10]);
+            _mm_storeu_si128((__m128i *)(output[j] + offset), s[j]);
+        }
+    }
+    for (size_t j = 0; j < count; ++j) {
+        _mm_storeu_si128((__m128i *)ctx[j]->iv.data, s[j]);
+    }
+}
+
+const struct Aes128Cbc_Backend Aes128Cbc_aesniBackend = {
+    .name = "aesni",
+    .capabilities = Aes128Cbc_HARDWARE
+        | Aes128Cbc_SIMD
+        | Aes128Cbc_CONSTANT_TIME,
+    .isSupported = isSupported,
+    .init = cbcInit,
+    .decrypt = cbcDecrypt,
+    .initMany = cbcInitMany,
+    .ecbDecrypt = ecbDecrypt,
+    .ctrInit = ctrInit,
+    .ctrDecrypt = ctrDecrypt,
+    .wideInit = wideInit,
+    .wideDecrypt = wideDecrypt,
+    .encInit = cbcEncInit,
+    .encrypt = cbcEncrypt};
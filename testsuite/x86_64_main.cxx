@@ -1,14 +1,20 @@
+#include <algorithm>
 #include <array>
 #include <bit>
+#include <coroutine>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <functional>
+#include <future>
 #include <iostream>
 #include <map>
+#include <sstream>
+#include <span>
 #include <string>
+#include <vector>
 #include <thread>
 
 #include "expect.hxx"
@@ -110,7 +116,15 @@ toArray(const std::string& m) -> std::array<std::uint8_t, 16>
 
 #include "Aes128Cbc.h"
 #include "x86_64_Aes128Cbc.c"
+#include "asyncdecrypt.hpp"
+#include "chunksize.hpp"
+#include "container.hpp"
+#include "decryptbuf.hpp"
+#include "decryptor.hpp"
 #include "evp.h"
+#include "pagebuffer.hpp"
+#include "roundkey.hpp"
+#include "sha256.h"
 
 static auto
 toKey(const std::string& m) -> Aes128Cbc_Key
@@ -293,7 +307,7 @@ main(int ac, char** av)
         struct Aes128Cbc_RoundKey roundKey;
         keyExpansion(&k, &roundKey);
         postKeyExpansion(&roundKey);
-        auto newState = eqInvCipher(state, &roundKey);
+        auto newState = eqInvCipher(state, roundKey.round, 10);
         dump(newState);
         uint8_t actual[16];
         _mm_storeu_si128((__m128i*)actual, newState);
@@ -324,5 +338,1396 @@ main(int ac, char** av)
         std::fclose(out);
         compare("alice.md", "alice.md.decrypted");
     });
+    driver.add("stats", [] {
+        unsigned char key[] = "0123456789abcdeF";
+        unsigned char iv[] = "1234567887654321";
+        std::array<unsigned char, 64> in {};
+        std::array<unsigned char, 64> out {};
+        int outlen;
+        auto* ctx = EVP_CIPHER_CTX_new();
+        expect(ctx) != nullptr;
+        expect(EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, iv)) == 1;
+        expect(EVP_DecryptUpdate(ctx, out.data(), &outlen, in.data(), 64)) == 1;
+        expect(EVP_DecryptUpdate(ctx, out.data(), &outlen, in.data(), 32)) == 1;
+        EVP_STATS stats;
+        if (EVP_CIPHER_CTX_get_stats(ctx, &stats, 1)) {
+            expect(stats.bytesDecrypted) == 96ull;
+            expect(stats.updateCalls) == 2ull;
+            expect(stats.averageUpdateSize) == 48ull;
+            expect(stats.keyExpansions) == 1ull;
+            expect(stats.allocations) == 2ull;
+            expect(EVP_CIPHER_CTX_get_stats(ctx, &stats, 0)) == 1;
+            expect(stats.updateCalls) == 0ull;
+        } else {
+            expect(stats.bytesDecrypted) == 0ull;
+            expect(stats.updateCalls) == 0ull;
+        }
+        EVP_CIPHER_CTX_free(ctx);
+    });
+    driver.add("backend", [] {
+        auto key = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        auto iv = toArray("000102030405060708090a0b0c0d0e0f");
+        std::array<const char*, 4> cipherText = {
+            "7649abac8119b246cee98e9b12e9197d",
+            "5086cb9b507219ee95db113a917678b2",
+            "73bed6b8e3c1743b7116e69e22229516",
+            "3ff1caa1681fac09120eca307586e1a7"};
+        std::array<const char*, 3> plainText = {
+            "6bc1bee22e409f96e93d7e117393172a",
+            "ae2d8a571e03ac9c9eb76fac45af8e51",
+            "30c81c46a35ce411e5fbc1191a0a52ef"};
+        std::array<unsigned char, 64> in;
+        for (auto k = 0; k < 4; ++k) {
+            auto block = toArray(cipherText[k]);
+            std::memcpy(&in[k * 16], block.data(), 16);
+        }
+        expect(EVP_aes_backend_name()) != nullptr;
+        expect(EVP_aes_backend_select("no such backend")) == 0;
+        const char* name;
+        unsigned int capabilities;
+        int supported;
+        for (auto i = 0;
+                (name = EVP_aes_backend_get(i, &capabilities, &supported))
+                    != nullptr;
+                ++i) {
+            if (!supported) {
+                expect(EVP_aes_backend_select(name)) == 0;
+                continue;
+            }
+            expect(EVP_aes_backend_select(name)) == 1;
+            expect(std::string {EVP_aes_backend_name()}) == std::string {name};
+            expect(EVP_aes_backend_capabilities()) == capabilities;
+            std::array<unsigned char, 64> out;
+            int outlen;
+            auto* ctx = EVP_CIPHER_CTX_new();
+            expect(ctx) != nullptr;
+            expect(EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL,
+                key.data(), iv.data())) == 1;
+            expect(EVP_DecryptUpdate(ctx, out.data(), &outlen, in.data(), 64))
+                == 1;
+            EVP_CIPHER_CTX_free(ctx);
+            expect(outlen) == 48;
+            for (auto k = 0; k < 3; ++k) {
+                auto expected = toArray(plainText[k]);
+                for (auto j = 0; j < 16; ++j) {
+                    expect(out[k * 16 + j]) == expected[j];
+                }
+            }
+        }
+        expect(EVP_aes_backend_select(nullptr)) == 1;
+    });
+    driver.add("ctr (test vector)", [] {
+        auto key = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        auto iv = toArray("f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff");
+        std::array<const char*, 4> cipherText = {
+            "874d6191b620e3261bef6864990db6ce",
+            "9806f66b7970fdff8617187bb9fffdff",
+            "5ae4df3edbd5d35e5b4f09020db03eab",
+            "1e031dda2fbe03d1792170a0f3009cee"};
+        std::array<const char*, 4> plainText = {
+            "6bc1bee22e409f96e93d7e117393172a",
+            "ae2d8a571e03ac9c9eb76fac45af8e51",
+            "30c81c46a35ce411e5fbc1191a0a52ef",
+            "f69f2445df4f9b17ad2b417be66c3710"};
+        std::array<unsigned char, 64> in;
+        for (auto k = 0; k < 4; ++k) {
+            auto block = toArray(cipherText[k]);
+            std::memcpy(&in[k * 16], block.data(), 16);
+        }
+        const char* name;
+        int supported;
+        for (auto i = 0;
+                (name = EVP_aes_backend_get(i, nullptr, &supported)) != nullptr;
+                ++i) {
+            if (!supported) {
+                continue;
+            }
+            expect(EVP_aes_backend_select(name)) == 1;
+            std::array<unsigned char, 64> out;
+            int outlen;
+            auto* ctx = EVP_CIPHER_CTX_new();
+            expect(ctx) != nullptr;
+            expect(EVP_DecryptInit_ex(ctx, EVP_aes_128_ctr(), NULL,
+                key.data(), iv.data())) == 1;
+            auto offset = 0;
+            for (auto size : {1, 20, 43}) {
+                expect(EVP_DecryptUpdate(ctx, &out[offset], &outlen,
+                    &in[offset], size)) == 1;
+                expect(outlen) == size;
+                offset += size;
+            }
+            expect(EVP_DecryptFinal_ex(ctx, &out[offset], &outlen)) == 1;
+            expect(outlen) == 0;
+            EVP_CIPHER_CTX_free(ctx);
+            for (auto k = 0; k < 4; ++k) {
+                auto expected = toArray(plainText[k]);
+                for (auto j = 0; j < 16; ++j) {
+                    expect(out[k * 16 + j]) == expected[j];
+                }
+            }
+        }
+        expect(EVP_aes_backend_select(nullptr)) == 1;
+    });
+    driver.add("ctr (counter carry)", [] {
+        auto key = toArray("000102030405060708090a0b0c0d0e0f");
+        auto iv = toArray("0123456789abcdeffffffffffffffffa");
+        std::array<unsigned char, 16 * 21 + 7> in;
+        for (auto k = 0u; k < in.size(); ++k) {
+            in[k] = (unsigned char)k;
+        }
+        std::vector<std::vector<unsigned char>> results;
+        const char* name;
+        int supported;
+        for (auto i = 0;
+                (name = EVP_aes_backend_get(i, nullptr, &supported)) != nullptr;
+                ++i) {
+            if (!supported) {
+                continue;
+            }
+            expect(EVP_aes_backend_select(name)) == 1;
+            std::vector<unsigned char> out(in.size());
+            int outlen;
+            auto* ctx = EVP_CIPHER_CTX_new();
+            expect(ctx) != nullptr;
+            expect(EVP_DecryptInit_ex(ctx, EVP_aes_128_ctr(), NULL,
+                key.data(), iv.data())) == 1;
+            expect(EVP_DecryptUpdate(ctx, out.data(), &outlen, in.data(),
+                (int)in.size())) == 1;
+            EVP_CIPHER_CTX_free(ctx);
+            results.push_back(out);
+        }
+        expect(EVP_aes_backend_select(nullptr)) == 1;
+        for (const auto& r : results) {
+            expect(r == results[0]).isTrue();
+        }
+    });
+    driver.add("aes192/256 cbc (test vector)", [] {
+        struct Vector {
+            const EVP_CIPHER* cipher;
+            const char* key;
+            std::array<const char*, 4> cipherText;
+        };
+        std::array<Vector, 2> vectors = {
+            Vector {EVP_aes_192_cbc(),
+                "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+                {"4f021db243bc633d7178183a9fa071e8",
+                    "b4d9ada9ad7dedf4e5e738763f69145a",
+                    "571b242012fb7ae07fa9baac3df102e0",
+                    "08b0e27988598881d920a9e64f5615cd"}},
+            Vector {EVP_aes_256_cbc(),
+                "603deb1015ca71be2b73aef0857d7781"
+                "1f352c073b6108d72d9810a30914dff4",
+                {"f58c4c04d6e5f1ba779eabfb5f7bfbd6",
+                    "9cfc4e967edb808d679f777bc6702c7d",
+                    "39f23369a9d9bacfa530e26304231461",
+                    "b2eb05e2c39be9fcda6c19078c6a9d1b"}}};
+        std::array<const char*, 3> plainText = {
+            "6bc1bee22e409f96e93d7e117393172a",
+            "ae2d8a571e03ac9c9eb76fac45af8e51",
+            "30c81c46a35ce411e5fbc1191a0a52ef"};
+        auto iv = toArray("000102030405060708090a0b0c0d0e0f");
+        const char* name;
+        int supported;
+        for (const auto& v : vectors) {
+            std::string hex {v.key};
+            std::vector<unsigned char> key;
+            for (auto k = 0u; k < hex.length(); k += 2) {
+                key.push_back((unsigned char)std::stoull(hex.substr(k, 2),
+                    nullptr, 16));
+            }
+            std::array<unsigned char, 64> in;
+            for (auto k = 0; k < 4; ++k) {
+                auto block = toArray(v.cipherText[k]);
+                std::memcpy(&in[k * 16], block.data(), 16);
+            }
+            for (auto i = 0;
+                    (name = EVP_aes_backend_get(i, nullptr, &supported))
+                        != nullptr;
+                    ++i) {
+                if (!supported) {
+                    continue;
+                }
+                expect(EVP_aes_backend_select(name)) == 1;
+                std::array<unsigned char, 64> out;
+                int outlen;
+                auto* ctx = EVP_CIPHER_CTX_new();
+                expect(ctx) != nullptr;
+                expect(EVP_DecryptInit_ex(ctx, v.cipher, NULL,
+                    key.data(), iv.data())) == 1;
+                expect(EVP_DecryptUpdate(ctx, out.data(), &outlen, in.data(),
+                    64)) == 1;
+                EVP_CIPHER_CTX_free(ctx);
+                expect(outlen) == 48;
+                for (auto k = 0; k < 3; ++k) {
+                    auto expected = toArray(plainText[k]);
+                    for (auto j = 0; j < 16; ++j) {
+                        expect(out[k * 16 + j]) == expected[j];
+                    }
+                }
+            }
+        }
+        expect(EVP_aes_backend_select(nullptr)) == 1;
+    });
+    driver.add("aes cbc (interleaved blocks)", [] {
+        std::array<unsigned char, 32> key;
+        std::array<unsigned char, 16> iv;
+        for (auto k = 0u; k < key.size(); ++k) {
+            key[k] = (unsigned char)(k * 7);
+        }
+        for (auto k = 0u; k < iv.size(); ++k) {
+            iv[k] = (unsigned char)(k * 3);
+        }
+        std::array<unsigned char, 16 * 21> in;
+        for (auto k = 0u; k < in.size(); ++k) {
+            in[k] = (unsigned char)(k * 5);
+        }
+        const char* name;
+        int supported;
+        for (auto* cipher :
+                {EVP_aes_128_cbc(), EVP_aes_192_cbc(), EVP_aes_256_cbc()}) {
+            std::vector<std::vector<unsigned char>> results;
+            for (auto i = 0;
+                    (name = EVP_aes_backend_get(i, nullptr, &supported))
+                        != nullptr;
+                    ++i) {
+                if (!supported) {
+                    continue;
+                }
+                expect(EVP_aes_backend_select(name)) == 1;
+                for (auto size : {16, (int)in.size()}) {
+                    std::vector<unsigned char> out(in.size());
+                    int outlen;
+                    auto* ctx = EVP_CIPHER_CTX_new();
+                    expect(ctx) != nullptr;
+                    expect(EVP_DecryptInit_ex(ctx, cipher, NULL,
+                        key.data(), iv.data())) == 1;
+                    auto offset = 0;
+                    for (auto k = 0; k < (int)in.size(); k += size) {
+                        expect(EVP_DecryptUpdate(ctx, &out[offset], &outlen,
+                            &in[k], size)) == 1;
+                        offset += outlen;
+                    }
+                    EVP_CIPHER_CTX_free(ctx);
+                    expect(offset) == (int)in.size() - 16;
+                    results.push_back(out);
+                }
+            }
+            for (const auto& r : results) {
+                expect(r == results[0]).isTrue();
+            }
+        }
+        expect(EVP_aes_backend_select(nullptr)) == 1;
+    });
+    driver.add("ecb (test vector)", [] {
+        auto key = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        std::array<const char*, 4> cipherText = {
+            "3ad77bb40d7a3660a89ecaf32466ef97",
+            "f5d3d58503b9699de785895a96fdbaaf",
+            "43b1cd7f598ece23881b00e3ed030688",
+            "7b0c785e27e8ad3f8223207104725dd4"};
+        std::array<const char*, 4> plainText = {
+            "6bc1bee22e409f96e93d7e117393172a",
+            "ae2d8a571e03ac9c9eb76fac45af8e51",
+            "30c81c46a35ce411e5fbc1191a0a52ef",
+            "f69f2445df4f9b17ad2b417be66c3710"};
+        // 21 blocks, so that both the interleaved and the single-block
+        // paths run
+        std::array<unsigned char, 16 * 21> in;
+        for (auto k = 0; k < 21; ++k) {
+            auto block = toArray(cipherText[k % 4]);
+            std::memcpy(&in[k * 16], block.data(), 16);
+        }
+        const char* name;
+        int supported;
+        for (auto i = 0;
+                (name = EVP_aes_backend_get(i, nullptr, &supported)) != nullptr;
+                ++i) {
+            if (!supported) {
+                continue;
+            }
+            expect(EVP_aes_backend_select(name)) == 1;
+            std::array<unsigned char, 16 * 21> out;
+            int outlen;
+            auto* ctx = EVP_CIPHER_CTX_new();
+            expect(ctx) != nullptr;
+            expect(EVP_DecryptInit_ex(ctx, EVP_aes_128_ecb(), NULL,
+                key.data(), NULL)) == 1;
+            expect(EVP_CIPHER_CTX_set_padding(ctx, 0)) == 1;
+            expect(EVP_DecryptUpdate(ctx, out.data(), &outlen, in.data(),
+                (int)in.size())) == 1;
+            expect(outlen) == (int)in.size();
+            expect(EVP_DecryptFinal_ex(ctx, out.data(), &outlen)) == 1;
+            expect(outlen) == 0;
+            EVP_CIPHER_CTX_free(ctx);
+            for (auto k = 0; k < 21; ++k) {
+                auto expected = toArray(plainText[k % 4]);
+                for (auto j = 0; j < 16; ++j) {
+                    expect(out[k * 16 + j]) == expected[j];
+                }
+            }
+        }
+        expect(EVP_aes_backend_select(nullptr)) == 1;
+    });
+    driver.add("set_padding", [] {
+        auto key = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        auto iv = toArray("000102030405060708090a0b0c0d0e0f");
+        auto cipherText = toArray("7649abac8119b246cee98e9b12e9197d");
+        auto plainText = toArray("6bc1bee22e409f96e93d7e117393172a");
+        std::array<unsigned char, 16> out;
+        int outlen;
+        auto* ctx = EVP_CIPHER_CTX_new();
+        expect(ctx) != nullptr;
+        expect(EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL,
+            key.data(), iv.data())) == 1;
+        expect(EVP_DecryptUpdate(ctx, out.data(), &outlen,
+            cipherText.data(), 16)) == 1;
+        expect(outlen) == 0;
+        expect(EVP_CIPHER_CTX_set_padding(ctx, 0)) == 1;
+        expect(EVP_DecryptFinal_ex(ctx, out.data(), &outlen)) == 1;
+        expect(outlen) == 16;
+        expect(out == plainText).isTrue();
+        EVP_CIPHER_CTX_free(ctx);
+    });
+    driver.add("encrypt (test vector)", [] {
+        auto key = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        auto iv = toArray("000102030405060708090a0b0c0d0e0f");
+        std::array<const char*, 4> plainText = {
+            "6bc1bee22e409f96e93d7e117393172a",
+            "ae2d8a571e03ac9c9eb76fac45af8e51",
+            "30c81c46a35ce411e5fbc1191a0a52ef",
+            "f69f2445df4f9b17ad2b417be66c3710"};
+        std::array<const char*, 4> cipherText = {
+            "7649abac8119b246cee98e9b12e9197d",
+            "5086cb9b507219ee95db113a917678b2",
+            "73bed6b8e3c1743b7116e69e22229516",
+            "3ff1caa1681fac09120eca307586e1a7"};
+        std::array<unsigned char, 64> in;
+        for (auto k = 0; k < 4; ++k) {
+            auto block = toArray(plainText[k]);
+            std::memcpy(&in[k * 16], block.data(), 16);
+        }
+        const char* name;
+        int supported;
+        for (auto i = 0;
+                (name = EVP_aes_backend_get(i, nullptr, &supported)) != nullptr;
+                ++i) {
+            if (!supported) {
+                continue;
+            }
+            expect(EVP_aes_backend_select(name)) == 1;
+            std::array<unsigned char, 80> out;
+            int outlen;
+            auto* ctx = EVP_CIPHER_CTX_new();
+            expect(ctx) != nullptr;
+            expect(EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL,
+                key.data(), iv.data())) == 1;
+            auto offset = 0;
+            auto total = 0;
+            for (auto size : {5, 27, 32}) {
+                expect(EVP_EncryptUpdate(ctx, &out[total], &outlen,
+                    &in[offset], size)) == 1;
+                offset += size;
+                total += outlen;
+            }
+            expect(total) == 64;
+            expect(EVP_EncryptFinal_ex(ctx, &out[total], &outlen)) == 1;
+            expect(outlen) == 16;
+            expect(EVP_DecryptUpdate(ctx, out.data(), &outlen, in.data(),
+                16)) == 0;
+            EVP_CIPHER_CTX_free(ctx);
+            for (auto k = 0; k < 4; ++k) {
+                auto expected = toArray(cipherText[k]);
+                for (auto j = 0; j < 16; ++j) {
+                    expect(out[k * 16 + j]) == expected[j];
+                }
+            }
+
+            std::array<unsigned char, 80> decrypted;
+            ctx = EVP_CIPHER_CTX_new();
+            expect(ctx) != nullptr;
+            expect(EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL,
+                key.data(), iv.data())) == 1;
+            expect(EVP_DecryptUpdate(ctx, decrypted.data(), &outlen,
+                out.data(), 80)) == 1;
+            expect(outlen) == 64;
+            expect(EVP_DecryptFinal_ex(ctx, &decrypted[64], &outlen)) == 1;
+            expect(outlen) == 0;
+            EVP_CIPHER_CTX_free(ctx);
+            expect(std::memcmp(decrypted.data(), in.data(), 64)) == 0;
+        }
+        expect(EVP_aes_backend_select(nullptr)) == 1;
+    });
+    driver.add("encrypt (multiple streams)", [] {
+        constexpr auto count = 11;
+        std::array<std::vector<unsigned char>, count> plainText;
+        std::array<std::array<unsigned char, 16>, count> keys;
+        std::array<std::array<unsigned char, 16>, count> ivs;
+        for (auto k = 0; k < count; ++k) {
+            plainText[k].resize(k * 37 + 3);
+            for (auto j = 0u; j < plainText[k].size(); ++j) {
+                plainText[k][j] = (unsigned char)(j * 13 + k);
+            }
+            for (auto j = 0; j < 16; ++j) {
+                keys[k][j] = (unsigned char)(k * 16 + j);
+                ivs[k][j] = (unsigned char)(k + j * 7);
+            }
+        }
+        auto encryptOne = [&](int k) {
+            std::vector<unsigned char> out(plainText[k].size() + 16);
+            int outlen;
+            int total;
+            auto* ctx = EVP_CIPHER_CTX_new();
+            expect(EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL,
+                keys[k].data(), ivs[k].data())) == 1;
+            expect(EVP_EncryptUpdate(ctx, out.data(), &total,
+                plainText[k].data(), (int)plainText[k].size())) == 1;
+            expect(EVP_EncryptFinal_ex(ctx, &out[total], &outlen)) == 1;
+            EVP_CIPHER_CTX_free(ctx);
+            out.resize(total + outlen);
+            return out;
+        };
+        const char* name;
+        int supported;
+        for (auto i = 0;
+                (name = EVP_aes_backend_get(i, nullptr, &supported)) != nullptr;
+                ++i) {
+            if (!supported) {
+                continue;
+            }
+            expect(EVP_aes_backend_select(name)) == 1;
+            std::array<EVP_CIPHER_CTX*, count> ctx;
+            std::array<std::vector<unsigned char>, count> out;
+            std::array<int, count> total {};
+            for (auto k = 0; k < count; ++k) {
+                ctx[k] = EVP_CIPHER_CTX_new();
+                expect(EVP_EncryptInit_ex(ctx[k], EVP_aes_128_cbc(), NULL,
+                    keys[k].data(), ivs[k].data())) == 1;
+                out[k].resize(plainText[k].size() + 16);
+            }
+            // Two calls, so that some streams have a partial block left
+            for (auto half : {0, 1}) {
+                std::array<unsigned char*, count> o;
+                std::array<const unsigned char*, count> p;
+                std::array<int, count> inl;
+                std::array<int, count> outl;
+                for (auto k = 0; k < count; ++k) {
+                    auto size = (int)plainText[k].size();
+                    auto start = half ? size / 2 : 0;
+                    o[k] = &out[k][total[k]];
+                    p[k] = &plainText[k][start];
+                    inl[k] = half ? size - start : size / 2;
+                }
+                expect(EVP_EncryptUpdate_multi(ctx.data(), o.data(),
+                    outl.data(), p.data(), inl.data(), count)) == 1;
+                for (auto k = 0; k < count; ++k) {
+                    total[k] += outl[k];
+                }
+            }
+            for (auto k = 0; k < count; ++k) {
+                int outlen;
+                expect(EVP_EncryptFinal_ex(ctx[k], &out[k][total[k]],
+                    &outlen)) == 1;
+                EVP_CIPHER_CTX_free(ctx[k]);
+                out[k].resize(total[k] + outlen);
+                expect(out[k] == encryptOne(k)).isTrue();
+            }
+        }
+        expect(EVP_aes_backend_select(nullptr)) == 1;
+    });
+    driver.add("init multi", [] {
+        constexpr auto count = 19;
+        std::array<std::array<unsigned char, 16>, count> keys;
+        std::array<std::array<unsigned char, 16>, count> ivs;
+        std::array<const unsigned char*, count> keyPointers;
+        std::array<const unsigned char*, count> ivPointers;
+        for (auto k = 0; k < count; ++k) {
+            for (auto j = 0; j < 16; ++j) {
+                keys[k][j] = (unsigned char)(k * 31 + j * 17);
+                ivs[k][j] = (unsigned char)(k * 5 + j);
+            }
+            keyPointers[k] = keys[k].data();
+            ivPointers[k] = ivs[k].data();
+        }
+        keys[3] = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        ivs[3] = toArray("000102030405060708090a0b0c0d0e0f");
+        std::array<unsigned char, 16 * 10> in;
+        auto block = toArray("7649abac8119b246cee98e9b12e9197d");
+        std::memcpy(in.data(), block.data(), 16);
+        for (auto k = 16u; k < in.size(); ++k) {
+            in[k] = (unsigned char)(k * 3);
+        }
+        auto plainText = toArray("6bc1bee22e409f96e93d7e117393172a");
+        const char* name;
+        int supported;
+        for (auto i = 0;
+                (name = EVP_aes_backend_get(i, nullptr, &supported)) != nullptr;
+                ++i) {
+            if (!supported) {
+                continue;
+            }
+            expect(EVP_aes_backend_select(name)) == 1;
+            std::array<EVP_CIPHER_CTX*, count> ctx;
+            for (auto k = 0; k < count; ++k) {
+                ctx[k] = EVP_CIPHER_CTX_new();
+                expect(ctx[k]) != nullptr;
+            }
+            expect(EVP_DecryptInit_multi(ctx.data(), EVP_aes_128_cbc(),
+                keyPointers.data(), ivPointers.data(), count)) == 1;
+            expect(EVP_DecryptInit_multi(ctx.data(), EVP_aes_128_cbc(),
+                keyPointers.data(), ivPointers.data(), count)) == 0;
+            for (auto k = 0; k < count; ++k) {
+                std::array<unsigned char, 16 * 10> out;
+                std::array<unsigned char, 16 * 10> expected;
+                int outlen;
+                expect(EVP_DecryptUpdate(ctx[k], out.data(), &outlen,
+                    in.data(), (int)in.size())) == 1;
+                EVP_CIPHER_CTX_free(ctx[k]);
+                auto* one = EVP_CIPHER_CTX_new();
+                expect(EVP_DecryptInit_ex(one, EVP_aes_128_cbc(), NULL,
+                    keys[k].data(), ivs[k].data())) == 1;
+                expect(EVP_DecryptUpdate(one, expected.data(), &outlen,
+                    in.data(), (int)in.size())) == 1;
+                EVP_CIPHER_CTX_free(one);
+                expect(std::memcmp(out.data(), expected.data(), outlen)) == 0;
+                if (k == 3) {
+                    expect(std::memcmp(out.data(), plainText.data(), 16))
+                        == 0;
+                }
+            }
+        }
+        expect(EVP_aes_backend_select(nullptr)) == 1;
+    });
+    driver.add("padding check", [] {
+        auto key = toArray("000102030405060708090a0b0c0d0e0f");
+        auto iv = toArray("0f0e0d0c0b0a09080706050403020100");
+        struct Case {
+            const char* lastBlock;
+            int length;
+        };
+        std::array<Case, 10> cases = {
+            Case {"000102030405060708090a0b0c0d0e01", 15},
+            Case {"00010203040506070809030303030303", 13},
+            Case {"10101010101010101010101010101010", 0},
+            Case {"0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f0f", 1},
+            Case {"000102030405060708090a0b0c0d0e00", -1},
+            Case {"11111111111111111111111111111111", -1},
+            Case {"ff0102030405060708090a0b0c0d0eff", -1},
+            Case {"00010203040506070809030303030203", -1},
+            Case {"00101010101010101010101010101010", -1},
+            Case {"000102030405060708090a0b0c0d0102", -1}};
+        for (const auto& c : cases) {
+            auto plainText = toArray(c.lastBlock);
+            std::array<unsigned char, 16> cipherText;
+            int outlen;
+            auto* ctx = EVP_CIPHER_CTX_new();
+            expect(EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL,
+                key.data(), iv.data())) == 1;
+            expect(EVP_CIPHER_CTX_set_padding(ctx, 0)) == 1;
+            expect(EVP_EncryptUpdate(ctx, cipherText.data(), &outlen,
+                plainText.data(), 16)) == 1;
+            EVP_CIPHER_CTX_free(ctx);
+
+            std::array<unsigned char, 16> out;
+            ctx = EVP_CIPHER_CTX_new();
+            expect(EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL,
+                key.data(), iv.data())) == 1;
+            expect(EVP_DecryptUpdate(ctx, out.data(), &outlen,
+                cipherText.data(), 16)) == 1;
+            expect(outlen) == 0;
+            auto result = EVP_DecryptFinal_ex(ctx, out.data(), &outlen);
+            EVP_CIPHER_CTX_free(ctx);
+            if (c.length < 0) {
+                expect(result) == 0;
+                continue;
+            }
+            expect(result) == 1;
+            expect(outlen) == c.length;
+            expect(std::memcmp(out.data(), plainText.data(), c.length))
+                == 0;
+        }
+    });
+    driver.add("crc32c", [] {
+        auto crc32c = [](const std::vector<unsigned char>& data) {
+            std::uint32_t crc = 0xffffffff;
+            for (auto b : data) {
+                crc ^= b;
+                for (auto k = 0; k < 8; ++k) {
+                    crc = (crc >> 1) ^ ((crc & 1) ? 0x82f63b78 : 0);
+                }
+            }
+            return ~crc;
+        };
+        auto key = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        auto iv = toArray("000102030405060708090a0b0c0d0e0f");
+        auto encrypt = [&](const std::vector<unsigned char>& plainText) {
+            std::vector<unsigned char> out(plainText.size() + 16);
+            int outlen;
+            int total;
+            auto* ctx = EVP_CIPHER_CTX_new();
+            expect(EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL,
+                key.data(), iv.data())) == 1;
+            expect(EVP_EncryptUpdate(ctx, out.data(), &total,
+                plainText.data(), (int)plainText.size())) == 1;
+            expect(EVP_EncryptFinal_ex(ctx, &out[total], &outlen)) == 1;
+            EVP_CIPHER_CTX_free(ctx);
+            out.resize(total + outlen);
+            return out;
+        };
+        std::string digits {"123456789"};
+        std::vector<unsigned char> small {digits.begin(), digits.end()};
+        expect(crc32c(small)) == 0xe3069283u;
+        std::vector<unsigned char> large(9000);
+        for (auto k = 0u; k < large.size(); ++k) {
+            large[k] = (unsigned char)(k * 7 + (k >> 8));
+        }
+        for (const auto& plainText : {small, large}) {
+            auto cipherText = encrypt(plainText);
+            std::vector<unsigned char> out(cipherText.size());
+            int outlen;
+            unsigned int crc;
+            auto* ctx = EVP_CIPHER_CTX_new();
+            expect(EVP_CIPHER_CTX_enable_crc32c(ctx)) == 0;
+            expect(EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL,
+                key.data(), iv.data())) == 1;
+            expect(EVP_CIPHER_CTX_enable_crc32c(ctx)) == 1;
+            auto offset = 0;
+            auto total = 0;
+            auto size = (int)cipherText.size();
+            for (auto chunk : {16, 4096 + 32}) {
+                if (offset + chunk >= size) {
+                    break;
+                }
+                expect(EVP_DecryptUpdate(ctx, &out[total], &outlen,
+                    &cipherText[offset], chunk)) == 1;
+                offset += chunk;
+                total += outlen;
+            }
+            expect(EVP_DecryptUpdate(ctx, &out[total], &outlen,
+                &cipherText[offset], size - offset)) == 1;
+            total += outlen;
+            expect(EVP_DecryptFinal_crc32c(ctx, &out[total], &outlen, &crc))
+                == 1;
+            EVP_CIPHER_CTX_free(ctx);
+            total += outlen;
+            expect(total) == (int)plainText.size();
+            expect(crc) == crc32c(plainText);
+        }
+    });
+    driver.add("sha256", [] {
+        auto digest = [](const std::string& m) {
+            Sha256 ctx;
+            std::array<std::uint8_t, 32> out;
+            Sha256_init(&ctx);
+            Sha256_update(&ctx, m.data(), m.size());
+            Sha256_final(&ctx, out.data());
+            return out;
+        };
+        auto hex = [](const std::array<std::uint8_t, 32>& a) {
+            static const char digits[] = "0123456789abcdef";
+            std::string out;
+            for (auto b : a) {
+                out += digits[b >> 4];
+                out += digits[b & 15];
+            }
+            return out;
+        };
+        expect(hex(digest("abc"))) == std::string {
+            "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"};
+        expect(hex(digest(
+            "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq")))
+            == std::string {"248d6a61d20638b8e5c026930c3e6039"
+                "a33ce45964ff2167f6ecedd419db06c1"};
+        // RFC 4231, Test Case 2
+        HmacSha256 mac;
+        std::array<std::uint8_t, 32> tag;
+        std::string data {"what do ya want for nothing?"};
+        HmacSha256_init(&mac, "Jefe", 4);
+        HmacSha256_update(&mac, data.data(), data.size());
+        HmacSha256_final(&mac, tag.data());
+        expect(hex(tag)) == std::string {"5bdcc146bf60754e6a042426089575c7"
+            "5a003f089d2739839dec58b964ec3843"};
+    });
+    driver.add("encrypt-then-mac", [] {
+        auto key = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        auto iv = toArray("000102030405060708090a0b0c0d0e0f");
+        std::string macKey {"0123456789abcdef0123456789abcdef"};
+        std::vector<unsigned char> plainText(10000);
+        for (auto k = 0u; k < plainText.size(); ++k) {
+            plainText[k] = (unsigned char)(k * 11 + 1);
+        }
+        std::vector<unsigned char> cipherText(plainText.size() + 16);
+        int outlen;
+        int total;
+        auto* enc = EVP_CIPHER_CTX_new();
+        expect(EVP_EncryptInit_ex(enc, EVP_aes_128_cbc(), NULL,
+            key.data(), iv.data())) == 1;
+        expect(EVP_EncryptUpdate(enc, cipherText.data(), &total,
+            plainText.data(), (int)plainText.size())) == 1;
+        expect(EVP_EncryptFinal_ex(enc, &cipherText[total], &outlen)) == 1;
+        EVP_CIPHER_CTX_free(enc);
+        cipherText.resize(total + outlen);
+        std::array<std::uint8_t, 32> tag;
+        HmacSha256 mac;
+        HmacSha256_init(&mac, macKey.data(), macKey.size());
+        HmacSha256_update(&mac, iv.data(), iv.size());
+        HmacSha256_update(&mac, cipherText.data(), cipherText.size());
+        HmacSha256_final(&mac, tag.data());
+
+        auto* m = reinterpret_cast<const unsigned char*>(macKey.data());
+        auto size = (int)cipherText.size();
+        std::vector<unsigned char> out(cipherText.size());
+        auto* ctx = EVP_ETM_CTX_new();
+        expect(ctx) != nullptr;
+        expect(EVP_ETM_DecryptInit(ctx, key.data(), m, (int)macKey.size(),
+            iv.data())) == 1;
+        expect(EVP_ETM_DecryptUpdate(ctx, out.data(), &total,
+            cipherText.data(), 4096 + 16)) == 1;
+        expect(EVP_ETM_DecryptUpdate(ctx, &out[total], &outlen,
+            &cipherText[4096 + 16], size - 4096 - 16)) == 1;
+        total += outlen;
+        expect(EVP_ETM_DecryptFinal(ctx, &out[total], &outlen, tag.data(),
+            16)) == 1;
+        EVP_ETM_CTX_free(ctx);
+        total += outlen;
+        expect(total) == (int)plainText.size();
+        expect(std::memcmp(out.data(), plainText.data(), total)) == 0;
+
+        expect(EVP_ETM_decrypt(key.data(), m, (int)macKey.size(), iv.data(),
+            cipherText.data(), size, tag.data(), 32, out.data(), &outlen))
+            == 1;
+        expect(outlen) == (int)plainText.size();
+        expect(std::memcmp(out.data(), plainText.data(), outlen)) == 0;
+
+        cipherText[100] ^= 1;
+        ctx = EVP_ETM_CTX_new();
+        expect(EVP_ETM_DecryptInit(ctx, key.data(), m, (int)macKey.size(),
+            iv.data())) == 1;
+        expect(EVP_ETM_DecryptUpdate(ctx, out.data(), &total,
+            cipherText.data(), size)) == 1;
+        expect(EVP_ETM_DecryptFinal(ctx, &out[total], &outlen, tag.data(),
+            32)) == 0;
+        EVP_ETM_CTX_free(ctx);
+        expect(EVP_ETM_decrypt(key.data(), m, (int)macKey.size(), iv.data(),
+            cipherText.data(), size, tag.data(), 32, out.data(), &outlen))
+            == 0;
+        std::vector<unsigned char> zero(out.size());
+        expect(out == zero).isTrue();
+    });
+    driver.add("decryptUpdate_iov", [] {
+        auto key = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        auto iv = toArray("000102030405060708090a0b0c0d0e0f");
+        std::vector<unsigned char> plainText(3001);
+        for (auto k = 0u; k < plainText.size(); ++k) {
+            plainText[k] = (unsigned char)(k * 7 + 3);
+        }
+        std::vector<unsigned char> cipherText(plainText.size() + 16);
+        int outlen;
+        int total;
+        auto* enc = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(enc, EVP_aes_128_cbc(), NULL, key.data(),
+            iv.data());
+        EVP_EncryptUpdate(enc, cipherText.data(), &total, plainText.data(),
+            (int)plainText.size());
+        EVP_EncryptFinal_ex(enc, &cipherText[total], &outlen);
+        EVP_CIPHER_CTX_free(enc);
+        cipherText.resize(total + outlen);
+
+        auto split = [](unsigned char* p, std::size_t size,
+                std::initializer_list<std::size_t> lengths) {
+            std::vector<EVP_IOVEC> v;
+            for (auto n : lengths) {
+                n = std::min(n, size);
+                v.push_back({p, n});
+                p += n;
+                size -= n;
+            }
+            v.push_back({p, size});
+            return v;
+        };
+        auto* in = cipherText.data();
+        auto size = cipherText.size();
+        std::vector<unsigned char> out(size);
+        auto inVec = split(in, 1024, {1, 0, 7, 15, 16, 33, 200, 3});
+        auto inVec2 = split(in + 1024, size - 1024, {5, 130, 600});
+        auto outVec = split(out.data(), out.size(),
+            {3, 16, 17, 129, 0, 1000, 2});
+        auto* ctx = EVP_CIPHER_CTX_new();
+        EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key.data(),
+            iv.data());
+        expect(EVP_DecryptUpdate_iov(ctx, outVec.data(), (int)outVec.size(),
+            &total, inVec.data(), (int)inVec.size())) == 1;
+        expect(total) == 1024 - 16;
+        auto outVec2 = split(&out[total], out.size() - total, {77, 5});
+        expect(EVP_DecryptUpdate_iov(ctx, outVec2.data(),
+            (int)outVec2.size(), &outlen, inVec2.data(),
+            (int)inVec2.size())) == 1;
+        total += outlen;
+        expect(EVP_DecryptFinal_ex(ctx, &out[total], &outlen)) == 1;
+        EVP_CIPHER_CTX_free(ctx);
+        total += outlen;
+        expect(total) == (int)plainText.size();
+        expect(std::memcmp(out.data(), plainText.data(), total)) == 0;
+
+        // Too small output, and a partial block
+        std::vector<EVP_IOVEC> small = {{out.data(), 16}};
+        std::vector<EVP_IOVEC> partial = {{in, 17}};
+        ctx = EVP_CIPHER_CTX_new();
+        EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key.data(),
+            iv.data());
+        expect(EVP_DecryptUpdate_iov(ctx, small.data(), 1, &outlen,
+            inVec.data(), (int)inVec.size())) == 0;
+        expect(EVP_DecryptUpdate_iov(ctx, outVec.data(), (int)outVec.size(),
+            &outlen, partial.data(), 1)) == 0;
+        EVP_CIPHER_CTX_free(ctx);
+
+        // A block held back before the padding is disabled is written too
+        std::vector<EVP_IOVEC> next = {{in + 16, 16}};
+        std::vector<EVP_IOVEC> one = {{out.data(), 16}};
+        std::vector<EVP_IOVEC> two = {{out.data(), 16}, {&out[16], 16}};
+        ctx = EVP_CIPHER_CTX_new();
+        EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key.data(),
+            iv.data());
+        expect(EVP_DecryptUpdate(ctx, out.data(), &outlen, in, 16)) == 1;
+        expect(outlen) == 0;
+        EVP_CIPHER_CTX_set_padding(ctx, 0);
+        expect(EVP_DecryptUpdate_iov(ctx, one.data(), 1, &outlen,
+            next.data(), 1)) == 0;
+        expect(EVP_DecryptUpdate_iov(ctx, two.data(), 2, &outlen,
+            next.data(), 1)) == 1;
+        expect(outlen) == 32;
+        expect(std::memcmp(out.data(), plainText.data(), 32)) == 0;
+        EVP_CIPHER_CTX_free(ctx);
+
+        // CTR, with segments of any length
+        std::vector<unsigned char> ctrOut(plainText.size());
+        std::vector<unsigned char> ctrIov(plainText.size());
+        ctx = EVP_CIPHER_CTX_new();
+        EVP_DecryptInit_ex(ctx, EVP_aes_128_ctr(), NULL, key.data(),
+            iv.data());
+        EVP_DecryptUpdate(ctx, ctrOut.data(), &outlen, plainText.data(),
+            (int)plainText.size());
+        EVP_CIPHER_CTX_free(ctx);
+        auto ctrIn = split(plainText.data(), plainText.size(),
+            {1, 2, 3, 100, 1000});
+        auto ctrOutVec = split(ctrIov.data(), ctrIov.size(), {7, 9, 2000});
+        ctx = EVP_CIPHER_CTX_new();
+        EVP_DecryptInit_ex(ctx, EVP_aes_128_ctr(), NULL, key.data(),
+            iv.data());
+        expect(EVP_DecryptUpdate_iov(ctx, ctrOutVec.data(),
+            (int)ctrOutVec.size(), &outlen, ctrIn.data(),
+            (int)ctrIn.size())) == 1;
+        EVP_CIPHER_CTX_free(ctx);
+        expect(outlen) == (int)plainText.size();
+        expect(ctrIov == ctrOut).isTrue();
+    });
+    driver.add("decryptor", [] {
+        auto key = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        auto iv = toArray("000102030405060708090a0b0c0d0e0f");
+        std::vector<unsigned char> plainText(100);
+        for (auto k = 0u; k < plainText.size(); ++k) {
+            plainText[k] = (unsigned char)(k * 5 + 2);
+        }
+        std::vector<unsigned char> cipherText(plainText.size() + 16);
+        int outlen;
+        int total;
+        auto* enc = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(enc, EVP_aes_128_cbc(), NULL, key.data(),
+            iv.data());
+        EVP_EncryptUpdate(enc, cipherText.data(), &total, plainText.data(),
+            (int)plainText.size());
+        EVP_EncryptFinal_ex(enc, &cipherText[total], &outlen);
+        EVP_CIPHER_CTX_free(enc);
+        cipherText.resize(total + outlen);
+
+        auto keyBytes = std::as_bytes(std::span {key});
+        auto ivBytes = std::as_bytes(std::span {iv});
+        expect(mimicssl::Decryptor::make(EVP_aes_256_cbc(), keyBytes,
+            ivBytes).has_value()) == false;
+        auto d = mimicssl::Decryptor::make(EVP_aes_128_cbc(), keyBytes,
+            ivBytes);
+        expect(d.has_value()) == true;
+        auto moved = std::move(*d);
+        expect(d->native()) == nullptr;
+        auto in = std::as_bytes(std::span {cipherText});
+        std::vector<std::byte> out(cipherText.size());
+        std::span<std::byte> rest {out};
+        expect(moved.update(in.first(64), rest.first(32)).has_value())
+            == false;
+        auto first = moved.update(in.first(64), rest);
+        expect(first.has_value()) == true;
+        expect(first->size()) == 48u;
+        rest = rest.subspan(first->size());
+        auto second = moved.update(in.subspan(64), rest);
+        expect(second->size()) == in.size() - 64;
+        rest = rest.subspan(second->size());
+        auto last = moved.finish(rest);
+        expect(last.has_value()) == true;
+        auto size = first->size() + second->size() + last->size();
+        expect(size) == plainText.size();
+        expect(std::memcmp(out.data(), plainText.data(), size)) == 0;
+
+        // Disabling the padding after an update releases the held block
+        auto late = mimicssl::Decryptor::make(EVP_aes_128_cbc(), keyBytes,
+            ivBytes);
+        expect(late->update(in.first(16), out)->size()) == 0u;
+        late->setPadding(false);
+        std::span<std::byte> whole {out};
+        expect(late->update(in.subspan(16, 16), whole.first(16))
+            .has_value()) == false;
+        expect(late->update(in.subspan(16, 16), whole.first(32))->size())
+            == 32u;
+        expect(std::memcmp(out.data(), plainText.data(), 32)) == 0;
+    });
+    driver.add("decryptBuf", [] {
+        auto key = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        auto iv = toArray("000102030405060708090a0b0c0d0e0f");
+        std::string plainText;
+        for (auto k = 0; k < 20000; ++k) {
+            plainText += "line " + std::to_string(k) + "\n";
+        }
+        std::string cipherText(plainText.size() + 16, '\0');
+        int outlen;
+        int total;
+        auto* enc = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(enc, EVP_aes_128_cbc(), NULL, key.data(),
+            iv.data());
+        EVP_EncryptUpdate(enc, (unsigned char*)cipherText.data(), &total,
+            (const unsigned char*)plainText.data(), (int)plainText.size());
+        EVP_EncryptFinal_ex(enc, (unsigned char*)&cipherText[total],
+            &outlen);
+        EVP_CIPHER_CTX_free(enc);
+        cipherText.resize(total + outlen);
+
+        auto keyBytes = std::as_bytes(std::span {key});
+        auto ivBytes = std::as_bytes(std::span {iv});
+        auto newDecryptor = [&] {
+            return *mimicssl::Decryptor::make(EVP_aes_128_cbc(), keyBytes,
+                ivBytes);
+        };
+        {
+            std::stringbuf source {cipherText};
+            mimicssl::DecryptBuf buf {newDecryptor(), &source};
+            std::istream in {&buf};
+            std::string line;
+            std::getline(in, line);
+            expect(line) == std::string {"line 0"};
+            std::string rest(plainText.size() - 7, '\0');
+            in.read(rest.data(), (std::streamsize)rest.size());
+            expect(in.gcount()) == (std::streamsize)rest.size();
+            expect(rest == plainText.substr(7)).isTrue();
+            expect(in.get()) == std::char_traits<char>::eof();
+            expect(buf.failed()) == false;
+        }
+        {
+            std::stringbuf source {cipherText};
+            mimicssl::DecryptBuf buf {newDecryptor(), &source};
+            std::istream in {&buf};
+            std::string all {std::istreambuf_iterator<char> {in},
+                std::istreambuf_iterator<char> {}};
+            expect(all == plainText).isTrue();
+        }
+        {
+            std::stringbuf source {cipherText};
+            mimicssl::DecryptBuf buf {newDecryptor(), &source, 1000};
+            expect(buf.chunkSize()) == 992u;
+            std::istream in {&buf};
+            std::string all {std::istreambuf_iterator<char> {in},
+                std::istreambuf_iterator<char> {}};
+            expect(all == plainText).isTrue();
+        }
+        {
+            auto broken = cipherText;
+            broken.back() ^= 1;
+            std::stringbuf source {broken};
+            mimicssl::DecryptBuf buf {newDecryptor(), &source};
+            std::istream in {&buf};
+            std::string all {std::istreambuf_iterator<char> {in},
+                std::istreambuf_iterator<char> {}};
+            expect(buf.failed()) == true;
+            expect(all.size() < plainText.size()).isTrue();
+        }
+    });
+    driver.add("decryptAsync", [] {
+        struct Task {
+            struct promise_type {
+                auto get_return_object() -> Task
+                {
+                    return {};
+                }
+                auto initial_suspend() noexcept -> std::suspend_never
+                {
+                    return {};
+                }
+                auto final_suspend() noexcept -> std::suspend_never
+                {
+                    return {};
+                }
+                void return_void()
+                {
+                }
+                void unhandled_exception()
+                {
+                    std::terminate();
+                }
+            };
+        };
+        struct Inline {
+            void execute(std::function<void()> f)
+            {
+                f();
+            }
+        };
+        auto key = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        auto iv = toArray("000102030405060708090a0b0c0d0e0f");
+        std::vector<unsigned char> plainText(100000);
+        for (auto k = 0u; k < plainText.size(); ++k) {
+            plainText[k] = (unsigned char)(k * 13 + 5);
+        }
+        std::vector<unsigned char> cipherText(plainText.size() + 16);
+        int outlen;
+        int total;
+        auto* enc = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(enc, EVP_aes_128_cbc(), NULL, key.data(),
+            iv.data());
+        EVP_EncryptUpdate(enc, cipherText.data(), &total, plainText.data(),
+            (int)plainText.size());
+        EVP_EncryptFinal_ex(enc, &cipherText[total], &outlen);
+        EVP_CIPHER_CTX_free(enc);
+        cipherText.resize(total + outlen);
+
+        auto keyBytes = std::as_bytes(std::span {key});
+        auto ivBytes = std::as_bytes(std::span {iv});
+        auto in = std::as_bytes(std::span {cipherText});
+        mimicssl::ThreadPool pool {4};
+        Inline inlineExecutor;
+        auto run = [&](auto& executor, std::span<const std::byte> input,
+                std::span<std::byte> out, std::size_t chunkSize,
+                const EVP_CIPHER* cipher = EVP_aes_128_cbc()) {
+            std::promise<std::optional<std::size_t>> result;
+            [](auto& executor, auto cipher, auto keyBytes, auto ivBytes,
+                    auto input, auto out, auto chunkSize,
+                    auto& result) -> Task {
+                result.set_value(co_await mimicssl::decryptAsync(executor,
+                    cipher, keyBytes, ivBytes, input, out, chunkSize));
+            }(executor, cipher, keyBytes, ivBytes, input, out, chunkSize,
+                result);
+            return result.get_future().get();
+        };
+        for (auto chunkSize : {4096u, 1000u, 1u << 20}) {
+            std::vector<std::byte> out(cipherText.size());
+            auto length = run(pool, in, out, chunkSize);
+            expect(length.has_value()) == true;
+            expect(*length) == plainText.size();
+            expect(std::memcmp(out.data(), plainText.data(), *length)) == 0;
+        }
+        {
+            std::vector<std::byte> out(cipherText.size());
+            auto length = run(inlineExecutor, in, out, 4096);
+            expect(length.has_value()) == true;
+            expect(std::memcmp(out.data(), plainText.data(), *length)) == 0;
+        }
+        {
+            std::vector<std::byte> out(cipherText.size());
+            auto length = run(pool, in.first(in.size() - 1), out, 4096);
+            expect(length.has_value()) == false;
+            auto broken = cipherText;
+            broken.back() ^= 1;
+            length = run(pool, std::as_bytes(std::span {broken}), out, 4096);
+            expect(length.has_value()) == false;
+        }
+        {
+            // The counter of each chunk carries into the upper 64 bits.
+            auto ctrIv = toArray("0001020304050607fffffffffffffffe");
+            std::vector<unsigned char> expected(1000);
+            auto* c = EVP_CIPHER_CTX_new();
+            EVP_DecryptInit_ex(c, EVP_aes_128_ctr(), NULL, key.data(),
+                ctrIv.data());
+            EVP_DecryptUpdate(c, expected.data(), &total, plainText.data(),
+                (int)expected.size());
+            EVP_CIPHER_CTX_free(c);
+            expect(total) == (int)expected.size();
+
+            ivBytes = std::as_bytes(std::span {ctrIv});
+            auto ctrIn = std::as_bytes(std::span {plainText}).first(1000);
+            std::vector<std::byte> out(ctrIn.size());
+            auto length = run(pool, ctrIn, out, 64, EVP_aes_128_ctr());
+            expect(length.has_value()) == true;
+            expect(*length) == expected.size();
+            expect(std::memcmp(out.data(), expected.data(), *length)) == 0;
+        }
+    });
+    driver.add("expandDecryptionKey", [] {
+        static constexpr auto ROUND_KEY = mimicssl::expandDecryptionKey({
+            0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+            0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c});
+        static_assert(ROUND_KEY[160] == 0xd0 && ROUND_KEY[175] == 0xa6);
+        auto key = toKey("2b7e151628aed2a6abf7158809cf4f3c");
+        auto iv = toArray("000102030405060708090a0b0c0d0e0f");
+        Aes128Cbc_Iv iv0;
+        std::memcpy(iv0.data, iv.data(), 16);
+        Aes128Cbc ctx;
+        Aes128Cbc_init(&ctx, &key, &iv0);
+        expect(std::memcmp(ctx.roundKey.round, ROUND_KEY.data(),
+            ROUND_KEY.size())) == 0;
+
+        // NIST SP 800-38A, F.2.2
+        auto in = toArray("7649abac8119b246cee98e9b12e9197d");
+        std::array<unsigned char, 16> out;
+        int outlen;
+        auto* c = EVP_CIPHER_CTX_new();
+        expect(EVP_DecryptInit_roundkey(c, EVP_aes_192_cbc(),
+            ROUND_KEY.data(), iv.data())) == 0;
+        expect(EVP_DecryptInit_roundkey(c, EVP_aes_128_cbc(),
+            ROUND_KEY.data(), iv.data())) == 1;
+        EVP_CIPHER_CTX_set_padding(c, 0);
+        expect(EVP_DecryptUpdate(c, out.data(), &outlen, in.data(), 16))
+            == 1;
+        expect(outlen) == 16;
+        expect(out == toArray("6bc1bee22e409f96e93d7e117393172a")).isTrue();
+        EVP_CIPHER_CTX_free(c);
+    });
+    driver.add("pageBuffer", [] {
+        using mimicssl::PageBuffer;
+        expect(PageBuffer::make(0).has_value()) == false;
+        for (auto huge : {false, true}) {
+            auto buffer = PageBuffer::make(3 * PageBuffer::PAGE_SIZE + 1,
+                huge);
+            expect(buffer.has_value()).isTrue();
+            expect(buffer->size()) == 3 * PageBuffer::PAGE_SIZE + 1;
+            auto address = reinterpret_cast<std::uintptr_t>(buffer->data());
+            expect(address % PageBuffer::PAGE_SIZE) == 0u;
+            if (buffer->pages() != PageBuffer::Pages::normal) {
+                expect(address % PageBuffer::HUGE_PAGE_SIZE) == 0u;
+            }
+            auto bytes = buffer->bytes();
+            std::ranges::fill(bytes, std::byte {0x5a});
+            expect(bytes.back() == std::byte {0x5a}).isTrue();
+            auto moved = std::move(*buffer);
+            expect(moved.data() == bytes.data()).isTrue();
+        }
+    });
+    driver.add("tuneChunkSize", [] {
+        using mimicssl::CacheSizes;
+        expect(CacheSizes::parseSize("48K").value()) == 48u * 1024;
+        expect(CacheSizes::parseSize("2M").value()) == 2u * 1024 * 1024;
+        expect(CacheSizes::parseSize("4096").value()) == 4096u;
+        expect(CacheSizes::parseSize("").has_value()) == false;
+        expect(CacheSizes::parseSize("K").has_value()) == false;
+        expect(CacheSizes::parseSize("1X").has_value()) == false;
+        expect(CacheSizes::parseSize("-1").has_value()) == false;
+        expect(CacheSizes::parseSize("1G").value()) == 1u << 30;
+        expect(CacheSizes::parseSize("2G").has_value()) == false;
+        expect(CacheSizes::parseSize("99999999999G").has_value()) == false;
+        expect(CacheSizes::parseSize("99999999999999999999").has_value())
+            == false;
+
+        auto candidates = mimicssl::detail::chunkCandidates(
+            {48 * 1024, 2048 * 1024, 0});
+        expect(std::ranges::is_sorted(candidates)).isTrue();
+        expect(std::ranges::adjacent_find(candidates) == candidates.end())
+            .isTrue();
+
+        auto tuning = mimicssl::tuneChunkSize();
+        expect(tuning.chunkSize % 16) == 0u;
+        expect(tuning.chunkSize >= mimicssl::detail::MIN_CHUNK_SIZE)
+            .isTrue();
+        expect(tuning.chunkSize <= mimicssl::detail::MAX_CHUNK_SIZE)
+            .isTrue();
+    });
+    driver.add("exportState", [] {
+        auto key = toArray("2b7e151628aed2a6abf7158809cf4f3c");
+        auto iv = toArray("000102030405060708090a0b0c0d0e0f");
+        std::vector<unsigned char> plainText(1000);
+        for (std::size_t k = 0; k < plainText.size(); ++k) {
+            plainText[k] = (unsigned char)(k * 7);
+        }
+        std::vector<unsigned char> cbc(plainText.size() + 16);
+        int outlen;
+        int total;
+        auto* enc = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(enc, EVP_aes_128_cbc(), NULL, key.data(),
+            iv.data());
+        EVP_EncryptUpdate(enc, cbc.data(), &total, plainText.data(),
+            (int)plainText.size());
+        EVP_EncryptFinal_ex(enc, cbc.data() + total, &outlen);
+        EVP_CIPHER_CTX_free(enc);
+        cbc.resize(total + outlen);
+
+        // Decrypts the first part with a context, and the rest with
+        // another one that imports the state of the former.
+        auto resume = [&](const EVP_CIPHER* cipher,
+                const std::vector<unsigned char>& in, int split, bool crc) {
+            std::vector<unsigned char> out(in.size() + 16);
+            unsigned char state[EVP_CIPHER_CTX_STATE_LENGTH];
+            int stateLength = 0;
+            int n = 0;
+            auto* first = EVP_CIPHER_CTX_new();
+            EVP_DecryptInit_ex(first, cipher, NULL, key.data(), iv.data());
+            if (crc) {
+                EVP_CIPHER_CTX_enable_crc32c(first);
+            }
+            expect(EVP_DecryptUpdate(first, out.data(), &n, in.data(), split))
+                == 1;
+            expect(EVP_CIPHER_CTX_export_state(first, state, &stateLength))
+                == 1;
+            expect(stateLength) == EVP_CIPHER_CTX_STATE_LENGTH;
+            EVP_CIPHER_CTX_free(first);
+
+            std::array<unsigned char, 16> zero {};
+            auto* second = EVP_CIPHER_CTX_new();
+            EVP_DecryptInit_ex(second, cipher, NULL, key.data(), zero.data());
+            expect(EVP_CIPHER_CTX_import_state(second, state, stateLength))
+                == 1;
+            int m = 0;
+            expect(EVP_DecryptUpdate(second, out.data() + n, &m,
+                in.data() + split, (int)in.size() - split)) == 1;
+            int last = 0;
+            unsigned int checksum = 0;
+            if (crc) {
+                expect(EVP_DecryptFinal_crc32c(second, out.data() + n + m,
+                    &last, &checksum)) == 1;
+            } else {
+                expect(EVP_DecryptFinal_ex(second, out.data() + n + m, &last))
+                    == 1;
+            }
+            EVP_CIPHER_CTX_free(second);
+            out.resize(n + m + last);
+            expect(out == plainText).isTrue();
+            return checksum;
+        };
+        resume(EVP_aes_128_cbc(), cbc, 512, false);
+        resume(EVP_aes_128_cbc(), cbc, 0, false);
+        expect(resume(EVP_aes_128_cbc(), cbc, 496, true))
+            == resume(EVP_aes_128_cbc(), cbc, 0, true);
+
+        std::vector<unsigned char> ctr(plainText.size());
+        {
+            auto* c = EVP_CIPHER_CTX_new();
+            EVP_DecryptInit_ex(c, EVP_aes_128_ctr(), NULL, key.data(),
+                iv.data());
+            EVP_DecryptUpdate(c, ctr.data(), &outlen, plainText.data(),
+                (int)plainText.size());
+            EVP_CIPHER_CTX_free(c);
+        }
+        resume(EVP_aes_128_ctr(), ctr, 333, false);
+
+        unsigned char state[EVP_CIPHER_CTX_STATE_LENGTH];
+        int stateLength = 0;
+        auto* c = EVP_CIPHER_CTX_new();
+        expect(EVP_CIPHER_CTX_export_state(c, state, &stateLength)) == 0;
+        EVP_DecryptInit_ex(c, EVP_aes_128_cbc(), NULL, key.data(), iv.data());
+        expect(EVP_CIPHER_CTX_export_state(c, state, &stateLength)) == 1;
+        expect(EVP_CIPHER_CTX_import_state(c, state, stateLength - 1)) == 0;
+        state[0] = 2;
+        expect(EVP_CIPHER_CTX_import_state(c, state, stateLength)) == 0;
+        state[0] = 1;
+        state[3] = 1;
+        expect(EVP_CIPHER_CTX_import_state(c, state, stateLength)) == 0;
+        state[3] = 0;
+        expect(EVP_CIPHER_CTX_import_state(c, state, stateLength)) == 1;
+        EVP_CIPHER_CTX_free(c);
+        c = EVP_CIPHER_CTX_new();
+        EVP_DecryptInit_ex(c, EVP_aes_128_ecb(), NULL, key.data(), NULL);
+        expect(EVP_CIPHER_CTX_import_state(c, state, stateLength)) == 0;
+        EVP_CIPHER_CTX_free(c);
+    });
+    driver.add("container", [] {
+        using mimicssl::ContainerReader;
+        auto toBytes = [](const auto& v) {
+            std::vector<std::byte> bytes(v.size());
+            std::ranges::transform(v, bytes.begin(), [](auto c) {
+                return (std::byte)c;
+            });
+            return bytes;
+        };
+        auto key = toBytes(toArray("2b7e151628aed2a6abf7158809cf4f3c"));
+        auto iv = toBytes(toArray("000102030405060708090a0b0c0d0e0f"));
+        std::span<const std::byte, 16> k16 {key.data(), 16};
+        std::span<const std::byte, 16> iv16 {iv.data(), 16};
+        std::vector<std::byte> plainText(1000);
+        for (std::size_t k = 0; k < plainText.size(); ++k) {
+            plainText[k] = (std::byte)(k * 7);
+        }
+        std::vector<std::byte> chunkIvs(4 * 16);
+        for (std::size_t k = 0; k < chunkIvs.size(); ++k) {
+            chunkIvs[k] = (std::byte)(k * 13 + 1);
+        }
+        mimicssl::ThreadPool pool {3};
+        for (auto withIvs : {false, true}) {
+            auto container = mimicssl::writeContainer(k16, iv16, plainText,
+                256, withIvs ? std::span<const std::byte> {chunkIvs}
+                    : std::span<const std::byte> {});
+            expect(container.has_value()).isTrue();
+            auto reader = ContainerReader::open(*container, k16);
+            expect(reader.has_value()).isTrue();
+            expect(reader->chunkCount()) == 4u;
+            expect(reader->chunkSize()) == 256u;
+
+            // Random access, starting from the last chunk.
+            std::vector<std::byte> out(256 + 16);
+            for (auto k : {3u, 0u, 2u, 1u}) {
+                auto n = reader->decryptChunk(k, out);
+                expect(n.has_value()).isTrue();
+                expect(*n) == ((k == 3) ? 1000u - 768u : 256u);
+                expect(std::ranges::equal(std::span {out}.first(*n),
+                    std::span {plainText}.subspan(k * 256, *n))).isTrue();
+            }
+            expect(reader->decryptChunk(4, out).has_value()) == false;
+
+            std::vector<std::byte> all(reader->ciphertextLength(0, 4));
+            expect(reader->decryptChunks(pool, 0, 4, all).value_or(0))
+                == 1000u;
+            all.resize(1000);
+            expect(all == plainText).isTrue();
+            std::vector<std::byte> middle(reader->ciphertextLength(1, 2));
+            expect(reader->decryptChunks(pool, 1, 2, middle).value_or(0))
+                == 512u;
+            expect(std::ranges::equal(middle,
+                std::span {plainText}.subspan(256, 512))).isTrue();
+        }
+
+        // The chunks of a chained container are a single CBC stream, so a
+        // reader accepts the ciphertext of any producer.
+        auto chained = *mimicssl::writeContainer(k16, iv16, plainText, 256);
+        auto dataStart = ContainerReader::Format::HEADER_SIZE + 5 * 8;
+        std::vector<unsigned char> cbc(1008);
+        int outlen;
+        int total;
+        auto* enc = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(enc, EVP_aes_128_cbc(), NULL,
+            (const unsigned char*)key.data(), (const unsigned char*)iv.data());
+        EVP_EncryptUpdate(enc, cbc.data(), &total,
+            (const unsigned char*)plainText.data(), 1000);
+        EVP_EncryptFinal_ex(enc, cbc.data() + total, &outlen);
+        EVP_CIPHER_CTX_free(enc);
+        expect(chained.size()) == dataStart + 1008;
+        expect(std::ranges::equal(std::span {chained}.subspan(dataStart),
+            toBytes(cbc))).isTrue();
+
+        // An empty plaintext is a single chunk of the padding.
+        auto empty = *mimicssl::writeContainer(k16, iv16, {}, 256);
+        auto emptyReader = ContainerReader::open(empty, k16);
+        expect(emptyReader->chunkCount()) == 1u;
+        std::vector<std::byte> padding(16);
+        expect(emptyReader->decryptChunk(0, padding).value_or(1)) == 0u;
+
+        auto broken = chained;
+        broken[ContainerReader::Format::HEADER_SIZE + 8] ^= std::byte {0x10};
+        expect(ContainerReader::open(broken, k16).has_value()) == false;
+        broken = chained;
+        broken[12] = std::byte {0x08};
+        expect(ContainerReader::open(broken, k16).has_value()) == false;
+        broken = chained;
+        broken.resize(broken.size() - 16);
+        expect(ContainerReader::open(broken, k16).has_value()) == false;
+        broken = chained;
+        broken.back() ^= std::byte {0x01};
+        auto brokenReader = ContainerReader::open(broken, k16);
+        expect(brokenReader.has_value()).isTrue();
+        std::vector<std::byte> all(1008);
+        expect(brokenReader->decryptChunks(pool, 0, 4, all).has_value())
+            == false;
+        expect(brokenReader->decryptChunk(0, all).has_value()).isTrue();
+    });
     return driver.run();
 }